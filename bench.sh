@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Time onebrc with different settings on cold and warm page cache.
+#
+# usage: bench.sh file [runs]
+#
+# Cold runs drop the page cache before each run, which needs root.
+
+set -eu
+
+file=$1
+runs=${2:-3}
+onebrc=${ONEBRC:-./onebrc}
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Best wall time in seconds of the runs of "$@".
+best() {
+    local cold=$1
+    shift
+    local best=
+    for _ in $(seq "$runs"); do
+        if [ "$cold" = cold ]; then
+            drop_caches
+        fi
+        local start=$(date +%s.%N)
+        "$onebrc" "$@" "$file" > /dev/null 2>&1
+        local end=$(date +%s.%N)
+        best=$(echo "$start $end ${best:-inf}" | awk '{ t = $2 - $1; print (t < $3 ? t : $3) }')
+    done
+    echo "$best"
+}
+
+measure() {
+    printf '%-40s %8.3f %8.3f\n' "$*" "$(best cold "$@")" "$(best warm "$@")"
+}
+
+printf '%-40s %8s %8s\n' options cold warm
+
+for hints in none populate sequential willneed hugepage fadvise readahead \
+    sequential,hugepage,fadvise populate,hugepage willneed,hugepage; do
+    measure --map-hints=$hints
+done
+
+for io in mmap private pread stream uring; do
+    measure --io=$io
+done
+
+for hints in none populate hugepage populate,hugepage; do
+    measure --io=private --map-hints=$hints
+done
+
+for pin in none compact scatter cores all; do
+    measure --pin=$pin
+done
+
+for numa in "" "--numa" "--numa --pin=compact" "--numa --io=pread"; do
+    measure $numa
+done
+
+for spin in 0 50 500; do
+    measure --spin=$spin
+done
+
+for chunk in 1M 4M 16M 64M; do
+    measure --chunk-size=$chunk
+    measure --chunk-size=$chunk --fixed-chunks
+done
+
+for prefetch in "--prefetch=0" "--prefetch=1" "--prefetch=2" "--prefetch=2 --prefetch-distance=16M"; do
+    measure $prefetch
+done
+
+for rss in 64M 1G; do
+    measure --max-rss=$rss
+done
+
+for format in tsv csv json 1brc arrow; do
+    measure --format=$format
+done
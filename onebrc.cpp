@@ -1,45 +1,131 @@
+#include <linux/io_uring.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <dirent.h>
 
+#include <endian.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#ifdef ONEBRC_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ONEBRC_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <coroutine>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <future>
-#include <iomanip>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
-using std::async;
+using std::atomic;
+using std::atomic_thread_fence;
+using std::bad_alloc;
+using std::ceil;
 using std::cerr;
-using std::cout;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::clamp;
+using std::condition_variable;
+using std::copy;
+using std::coroutine_handle;
+using std::current_exception;
+using std::deque;
+using std::endian;
 using std::endl;
-using std::fixed;
-using std::future;
+using std::exception_ptr;
+using std::exception;
+using std::exchange;
+using std::find_if;
+using std::function;
+using std::getline;
+using std::ifstream;
+using std::inplace_merge;
 using std::invalid_argument;
-using std::launch;
+using std::is_same_v;
+using std::lock_guard;
+using std::lower_bound;
 using std::make_pair;
+using std::make_tuple;
+using std::make_move_iterator;
+using std::make_unique;
+using std::make_unique_for_overwrite;
 using std::map;
 using std::max;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
 using std::min;
+using std::minmax_element;
+using std::move;
+using std::mutex;
+using std::nullopt;
 using std::numeric_limits;
-using std::ostream;
+using std::optional;
 using std::pair;
+using std::remove_if;
+using std::rethrow_exception;
 using std::runtime_error;
-using std::setprecision;
+using std::sort;
+using std::span;
+using std::stable_sort;
 using std::string;
 using std::string_view;
+using std::suspend_never;
+using std::swap;
+using std::terminate;
+using std::this_thread::sleep_for;
+using std::this_thread::yield;
 using std::thread;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
 using std::unordered_map;
+using std::upper_bound;
+using std::vector;
 
 namespace {
 
@@ -92,41 +178,539 @@ inline pair<string_view, string_view> first_line(string_view s)
     }
 }
 
+// Summed over the lines of an input, which gives the same checksum however
+// the input is split between parsers, like the results.
+inline uint64_t line_checksum(string_view line)
+{
+    constexpr uint64_t k = 0x9e3779b97f4a7c15;
+    uint64_t h = line.size();
+    for (; line.size() >= sizeof(uint64_t); line.remove_prefix(sizeof(uint64_t))) {
+        uint64_t word;
+        memcpy(&word, line.data(), sizeof(word));
+        h = (h ^ word) * k;
+    }
+    uint64_t word = 0;
+    memcpy(&word, line.data(), line.size());
+    h = (h ^ word) * k;
+    return h ^ (h >> 32);
+}
+
+//----------------------------------------------------------------------------
+// Aggregators. Each one maintains a single summary of the measurements of a
+// station, statistics below is assembled from a compile-time list of them.
+
+struct count {
+    void add(int64_t)
+    {
+        ++n;
+    }
+
+    void merge(const count& c)
+    {
+        n += c.n;
+    }
+
+    size_t n {};
+};
+
+struct total {
+    void add(int64_t x)
+    {
+        sum += x;
+    }
+
+    void merge(const total& t)
+    {
+        sum += t.sum;
+    }
+
+    int64_t sum {};
+};
+
+struct minimum {
+    void add(int64_t x)
+    {
+        if (x < min) {
+            min = x;
+        }
+    }
+
+    void merge(const minimum& m)
+    {
+        add(m.min);
+    }
+
+    int64_t min { numeric_limits<int64_t>::max() };
+};
+
+struct maximum {
+    void add(int64_t x)
+    {
+        if (x > max) {
+            max = x;
+        }
+    }
+
+    void merge(const maximum& m)
+    {
+        add(m.max);
+    }
+
+    int64_t max { numeric_limits<int64_t>::min() };
+};
+
+// Exact distribution of values in tenths of a degree, in the range number()
+// accepts. A station keeps its values as they come while that is cheaper
+// than a bucket for each tenth between the lowest and the highest seen, so
+// that one seen a few times in a table costs a few bytes and one seen often
+// no more than the range it spans.
+struct histogram {
+    static constexpr int64_t lowest = -999;
+    static constexpr int64_t highest = 999;
+
+    void add(int64_t x)
+    {
+        if (!buckets.empty()) {
+            cover(x);
+            ++buckets[x - base];
+            return;
+        }
+        if (values.size() == values.capacity() && worth_counting(x, 1)) {
+            count_values();
+            add(x);
+            return;
+        }
+        values.push_back(static_cast<int16_t>(x));
+    }
+
+    // n values x.
+    void add(int64_t x, uint64_t n)
+    {
+        if (buckets.empty() && (values.size() + n <= values.capacity() || !worth_counting(x, n))) {
+            values.insert(values.end(), n, static_cast<int16_t>(x));
+            return;
+        }
+        if (buckets.empty()) {
+            count_values();
+        }
+        cover(x);
+        buckets[x - base] += n;
+    }
+
+    void merge(const histogram& h)
+    {
+        if (buckets.empty() && h.buckets.empty()) {
+            values.insert(values.end(), h.values.begin(), h.values.end());
+        } else {
+            h.each([&](int64_t x, uint64_t n) { add(x, n); });
+        }
+    }
+
+    // Calls f(x, n) for the n > 0 values x, in increasing order of x.
+    template <typename F>
+    void each(F f) const
+    {
+        if (!buckets.empty()) {
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                if (buckets[i]) {
+                    f(base + static_cast<int64_t>(i), buckets[i]);
+                }
+            }
+            return;
+        }
+        auto sorted = values;
+        sort(sorted.begin(), sorted.end());
+        for (size_t i = 0, j; i < sorted.size(); i = j) {
+            for (j = i + 1; j < sorted.size() && sorted[j] == sorted[i]; ++j) {
+            }
+            f(sorted[i], j - i);
+        }
+    }
+
+    // Nearest-rank percentile p of n values.
+    int64_t percentile(unsigned p, size_t n) const
+    {
+        const auto rank = max<size_t>(1, (n * p + 99) / 100);
+        size_t seen = 0;
+        auto result = highest;
+        each([&](int64_t x, uint64_t k) {
+            if (seen < rank && (seen += k) >= rank) {
+                result = x;
+            }
+        });
+        return result;
+    }
+
+    vector<int16_t> values; // Until buckets are cheaper.
+    int64_t base {}; // Value of the first bucket.
+    vector<uint64_t> buckets;
+
+private:
+    // Whether buckets for the values so far and n more values x would take
+    // no more room than the values.
+    bool worth_counting(int64_t x, uint64_t n) const
+    {
+        int64_t lo = x, hi = x;
+        for (const auto v : values) {
+            lo = min<int64_t>(lo, v);
+            hi = max<int64_t>(hi, v);
+        }
+        return (hi - lo + 1) * sizeof(uint64_t) <= (values.size() + n) * sizeof(int16_t);
+    }
+
+    void count_values()
+    {
+        if (!values.empty()) {
+            const auto [lo, hi] = minmax_element(values.begin(), values.end());
+            base = *lo;
+            buckets.assign(*hi - *lo + 1, 0);
+            for (const auto x : values) {
+                ++buckets[x - base];
+            }
+        }
+        vector<int16_t>().swap(values);
+    }
+
+    // Buckets from the lowest to the highest value seen, x included.
+    void cover(int64_t x)
+    {
+        if (buckets.empty()) {
+            base = x;
+            buckets.resize(1);
+        } else if (x < base) {
+            buckets.insert(buckets.begin(), base - x, 0);
+            base = x;
+        } else if (x - base >= static_cast<int64_t>(buckets.size())) {
+            buckets.resize(x - base + 1);
+        }
+    }
+};
+
 //----------------------------------------------------------------------------
 // Statistics data structure.
 
-struct statistics {
-    statistics() = default;
+template <typename... Aggregators>
+struct statistics : Aggregators... {
+    template <typename Aggregator>
+    static constexpr bool has = (is_same_v<Aggregator, Aggregators> || ...);
 
-    statistics(int64_t x)
-        : min { x }
-        , max { x }
-        , sum { x }
-        , n { 1 }
+    void update(int64_t x)
     {
+        (Aggregators::add(x), ...);
     }
 
     void update(const statistics& s)
     {
-        if (s.min < min) {
-            min = s.min;
+        (Aggregators::merge(s), ...);
+    }
+};
+
+// Combinations instantiated for the command line, from the cheapest up.
+using count_statistics = statistics<count>;
+using mean_statistics = statistics<count, total>;
+using default_statistics = statistics<count, total, minimum, maximum>;
+using full_statistics = statistics<count, total, minimum, maximum, histogram>;
+
+//----------------------------------------------------------------------------
+// Output text.
+
+// Longest number formatted below: a sign, 19 digits and a decimal point, or
+// 20 digits.
+constexpr size_t max_number_size = 21;
+
+constexpr char* format_integer(char* out, uint64_t x)
+{
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = static_cast<char>('0' + x % 10);
+        x /= 10;
+    } while (x);
+    while (p != digits + sizeof(digits)) {
+        *out++ = *p++;
+    }
+    return out;
+}
+
+// Tenths of a degree, as number() returns them, with one decimal.
+constexpr char* format_tenths(char* out, int64_t x)
+{
+    auto u = static_cast<uint64_t>(x);
+    if (x < 0) {
+        *out++ = '-';
+        u = 0 - u;
+    }
+    out = format_integer(out, u / 10);
+    *out++ = '.';
+    *out++ = static_cast<char>('0' + u % 10);
+    return out;
+}
+
+// The mean of n values in tenths, to the nearest tenth. Ties are rounded
+// towards positive infinity, like Math.round() in the reference
+// implementation, so that -0.05 is 0.0 rather than -0.1 or -0.0.
+constexpr int64_t rounded_mean(int64_t sum, size_t n)
+{
+    const auto d = 2 * static_cast<int64_t>(n);
+    const auto q = 2 * sum + static_cast<int64_t>(n);
+    return q / d - (q % d < 0);
+}
+
+constexpr bool formats_as(int64_t tenths, string_view expected)
+{
+    char s[max_number_size] {};
+    return string_view(s, format_tenths(s, tenths) - s) == expected;
+}
+
+static_assert(formats_as(0, "0.0"));
+static_assert(formats_as(7, "0.7"));
+static_assert(formats_as(-7, "-0.7"));
+static_assert(formats_as(999, "99.9"));
+static_assert(formats_as(-999, "-99.9"));
+static_assert(formats_as(numeric_limits<int64_t>::max(), "922337203685477580.7"));
+static_assert(formats_as(numeric_limits<int64_t>::min(), "-922337203685477580.8"));
+static_assert(rounded_mean(0, 1) == 0);
+static_assert(rounded_mean(10, 4) == 3); // 0.25 up
+static_assert(rounded_mean(-10, 4) == -2); // -0.25 up
+static_assert(rounded_mean(1, 2) == 1); // 0.05 up
+static_assert(rounded_mean(-1, 2) == 0); // -0.05 up, without a sign
+static_assert(rounded_mean(-1, 3) == 0);
+static_assert(rounded_mean(-2, 3) == -1);
+static_assert(rounded_mean(5, 3) == 2);
+static_assert(rounded_mean(-5, 3) == -2);
+static_assert(rounded_mean(-999 * 3 + 1, 3) == -999);
+
+// The memory of n objects, to be written as it is.
+template <typename T>
+string_view bytes(const T* data, size_t n)
+{
+    return { reinterpret_cast<const char*>(data), n * sizeof(T) };
+}
+
+// Output gathered in blocks and written at once: with one write(2), or for
+// more than a block, with writev(2) over all of them.
+struct output_buffer {
+    void append(string_view s)
+    {
+        commit(copy(s.begin(), s.end(), space(s.size())));
+    }
+
+    void append(char c)
+    {
+        char* const p = space(1);
+        *p = c;
+        commit(p + 1);
+    }
+
+    void integer(uint64_t x)
+    {
+        commit(format_integer(space(max_number_size), x));
+    }
+
+    void tenths(int64_t x)
+    {
+        commit(format_tenths(space(max_number_size), x));
+    }
+
+    // Writes everything appended so far and empties the buffer.
+    void write_to(int fd)
+    {
+        size_t first = 0;
+        while (first < iov_.size()) {
+            if (!iov_[first].iov_len) {
+                ++first;
+                continue;
+            }
+            const auto count = min<size_t>(iov_.size() - first, IOV_MAX);
+            const auto n = count == 1 ? write(fd, iov_[first].iov_base, iov_[first].iov_len) : writev(fd, &iov_[first], count);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw runtime_error(strerror(errno));
+            }
+            // Written in part, to a pipe or on a signal.
+            for (size_t left = n; left;) {
+                auto& v = iov_[first];
+                const auto done = min(left, v.iov_len);
+                v.iov_base = static_cast<char*>(v.iov_base) + done;
+                v.iov_len -= done;
+                left -= done;
+                first += !v.iov_len;
+            }
         }
-        if (s.max > max) {
-            max = s.max;
+        blocks_.clear();
+        iov_.clear();
+        capacity_ = 0;
+    }
+
+private:
+    static constexpr size_t block_size = 1 << 20;
+
+    // Room for n bytes at the end of the last block.
+    char* space(size_t n)
+    {
+        if (iov_.empty() || n > capacity_ - iov_.back().iov_len) {
+            capacity_ = max(block_size, n);
+            blocks_.push_back(make_unique_for_overwrite<char[]>(capacity_));
+            iov_.push_back({ blocks_.back().get(), 0 });
         }
-        sum += s.sum;
-        n += s.n;
+        return static_cast<char*>(iov_.back().iov_base) + iov_.back().iov_len;
     }
 
-    int64_t min { numeric_limits<int64_t>::max() };
-    int64_t max { numeric_limits<int64_t>::min() };
-    int64_t sum {};
-    size_t n {};
+    void commit(char* end)
+    {
+        iov_.back().iov_len = end - static_cast<char*>(iov_.back().iov_base);
+    }
+
+    vector<unique_ptr<char[]>> blocks_;
+    vector<iovec> iov_; // What is used of each block.
+    size_t capacity_ {};
+};
+
+//----------------------------------------------------------------------------
+// Output columns.
+
+enum class field { min, mean, max, count, percentile };
+
+struct column {
+    field what {};
+    unsigned p {}; // Percentile, for field::percentile.
+};
+
+enum class output_format {
+    tsv, // A line of tab-separated columns per station.
+    csv, // RFC 4180, with a header line.
+    json, // An array of objects, one per station.
+    canonical, // {name=min/mean/max, ...} as the reference implementation prints.
+    arrow, // Arrow IPC file.
+    arrow_stream, // Arrow IPC stream.
 };
 
-ostream& operator<<(ostream& os, const statistics& s)
+// As parse_columns() accepts it.
+string column_name(const column& c)
+{
+    switch (c.what) {
+    case field::min:
+        return "min";
+    case field::mean:
+        return "mean";
+    case field::max:
+        return "max";
+    case field::count:
+        return "count";
+    case field::percentile:
+        return "p" + to_string(c.p);
+    }
+    return {};
+}
+
+vector<column> parse_columns(string_view s)
+{
+    vector<column> result;
+    while (!s.empty()) {
+        const auto i = s.find_first_of(',');
+        const auto name = s.substr(0, i);
+        if (name == "min") {
+            result.push_back({ field::min });
+        } else if (name == "mean") {
+            result.push_back({ field::mean });
+        } else if (name == "max") {
+            result.push_back({ field::max });
+        } else if (name == "count") {
+            result.push_back({ field::count });
+        } else if (name.size() > 1 && name[0] == 'p' && name.size() <= 4) {
+            unsigned p = 0;
+            for (const auto c : name.substr(1)) {
+                p = p * 10 + digit(c);
+            }
+            if (p < 1 || p > 100) {
+                throw invalid_argument("percentile out of range");
+            }
+            result.push_back({ field::percentile, p });
+        } else {
+            throw invalid_argument("unknown column " + string(name));
+        }
+        s = i == string_view::npos ? string_view() : s.substr(i + 1);
+    }
+    if (result.empty()) {
+        throw invalid_argument("no columns");
+    }
+    return result;
+}
+
+// Whether Stats has all the aggregators needed for the columns.
+template <typename Stats>
+bool provides(const vector<column>& columns)
 {
-    return os << (s.min / 10.0) << '\t' << (s.sum / 10.0 / s.n) << '\t' << (s.max / 10.0);
+    for (const auto& c : columns) {
+        switch (c.what) {
+        case field::min:
+            if (!Stats::template has<minimum>) {
+                return false;
+            }
+            break;
+        case field::max:
+            if (!Stats::template has<maximum>) {
+                return false;
+            }
+            break;
+        case field::mean:
+            if (!Stats::template has<total>) {
+                return false;
+            }
+            break;
+        case field::count:
+            break;
+        case field::percentile:
+            if (!Stats::template has<histogram>) {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// In tenths of a degree, but for the count.
+template <typename Stats>
+int64_t value(const Stats& s, const column& c)
+{
+    switch (c.what) {
+    case field::min:
+        if constexpr (Stats::template has<minimum>) {
+            return s.min;
+        }
+        break;
+    case field::mean:
+        if constexpr (Stats::template has<total>) {
+            return rounded_mean(s.sum, s.n);
+        }
+        break;
+    case field::max:
+        if constexpr (Stats::template has<maximum>) {
+            return s.max;
+        }
+        break;
+    case field::count:
+        return s.n;
+    case field::percentile:
+        if constexpr (Stats::template has<histogram>) {
+            return s.percentile(c.p, s.n);
+        }
+        break;
+    }
+    return 0;
+}
+
+template <typename Stats>
+void print(output_buffer& out, const Stats& s, const column& c)
+{
+    if (c.what == field::count) {
+        out.integer(s.n);
+    } else {
+        out.tenths(value(s, c));
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -134,12 +718,18 @@ ostream& operator<<(ostream& os, const statistics& s)
 
 struct file_descr {
     friend struct mmap_file;
+    friend struct mmap_window;
+    friend struct stream_input;
+    friend struct uring_input;
+    friend struct decompress_input;
 
+    // Path "-" is standard input.
     file_descr(const string& path)
-        : fd_ { open(path.c_str(), O_RDONLY) }
+        : fd_ { path == "-" ? dup(STDIN_FILENO) : open(path.c_str(), O_RDONLY) }
+        , path_ { path }
     {
         if (fd_ == -1) {
-            throw runtime_error(strerror(errno));
+            throw runtime_error(path + ": " + strerror(errno));
         }
     }
 
@@ -150,110 +740,4371 @@ struct file_descr {
         }
     }
 
+    file_descr(file_descr&& other) noexcept
+        : fd_ { exchange(other.fd_, -1) }
+        , path_ { move(other.path_) }
+    {
+    }
+
     file_descr(const file_descr&) = delete;
     file_descr& operator=(const file_descr&) = delete;
 
-private:
-    int fd_ { -1 };
-};
+    // The same file opened again, with other flags.
+    file_descr reopen(int flags) const
+    {
+        return file_descr { fd_, flags, path_ };
+    }
 
-struct mmap_file {
-    mmap_file(file_descr fd)
+    // As opened, for errors.
+    const string& path() const
+    {
+        return path_;
+    }
+
+    size_t size() const
+    {
+        return status().st_size;
+    }
+
+    struct stat status() const
     {
         struct stat st;
-        if (fstat(fd.fd_, &st) == -1) {
-            throw runtime_error(strerror(errno));
-        }
-        size_ = st.st_size;
-        data_ = static_cast<char*>(mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd.fd_, 0));
-        if (!data_) {
+        if (fstat(fd_, &st) == -1) {
             throw runtime_error(strerror(errno));
         }
+        return st;
     }
 
-    ~mmap_file()
+    // Fewer than size bytes only at the end of file.
+    size_t read_at(char* data, size_t size, off_t offset) const
     {
-        if (data_ && munmap(data_, size_) == -1) {
-            cerr << "mmap_file: " << strerror(errno) << endl;
+        size_t done = 0;
+        while (done < size) {
+            const auto n = pread(fd_, data + done, size - done, offset + done);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw runtime_error(strerror(errno));
+            }
+            if (n == 0) {
+                break;
+            }
+            done += n;
         }
+        return done;
     }
 
-    mmap_file(const mmap_file&) = delete;
-    mmap_file& operator=(const mmap_file&) = delete;
-
-    operator const string_view() const
+    // Whether the file can be mapped, as opposed to pipes and devices.
+    bool regular() const
     {
-        return { data_, size_ };
+        struct stat st;
+        if (fstat(fd_, &st) == -1) {
+            throw runtime_error(strerror(errno));
+        }
+        return S_ISREG(st.st_mode);
     }
 
 private:
-    char* data_ {};
-    size_t size_ {};
-};
+    file_descr(int fd, int flags, const string& path)
+        : fd_ { open(("/proc/self/fd/" + to_string(fd)).c_str(), flags) }
+        , path_ { path }
+    {
+        if (fd_ == -1) {
+            throw runtime_error(path + ": " + strerror(errno));
+        }
+    }
 
-//----------------------------------------------------------------------------
-// Parse and process lines from text.
+    int fd_ { -1 };
+    string path_;
+};
 
-using ordered_statistics = map<string_view, statistics>;
-using unordered_statistics = unordered_map<string_view, statistics>;
+// Hints to the kernel about how the mapping is going to be read. Defaults
+// are what measured best with bench.sh on both cold and warm page cache:
+// populating up front serializes the faults in one thread, and WILLNEED or
+// explicit readahead of a file larger than memory evicts its own head.
+struct map_hints {
+    bool populate {}; // MAP_POPULATE
+    bool sequential { true }; // MADV_SEQUENTIAL
+    bool willneed {}; // MADV_WILLNEED
+    bool hugepage { true }; // MADV_HUGEPAGE
+    bool fadvise { true }; // POSIX_FADV_SEQUENTIAL on the descriptor
+    bool readahead {}; // readahead(2) of the whole file
+};
 
-unordered_statistics aggregate(string_view input)
+map_hints parse_map_hints(string_view s)
 {
-    unordered_statistics result(1000);
-
-    while (!input.empty()) {
-        const auto [line, other_lines] = first_line(input);
-        const auto [name, value] = record(line);
-        result[name].update(value);
-        input = other_lines;
+    map_hints result { false, false, false, false, false, false };
+    while (!s.empty()) {
+        const auto i = s.find_first_of(',');
+        const auto name = s.substr(0, i);
+        if (name == "populate") {
+            result.populate = true;
+        } else if (name == "sequential") {
+            result.sequential = true;
+        } else if (name == "willneed") {
+            result.willneed = true;
+        } else if (name == "hugepage") {
+            result.hugepage = true;
+        } else if (name == "fadvise") {
+            result.fadvise = true;
+        } else if (name == "readahead") {
+            result.readahead = true;
+        } else if (name != "none") {
+            throw invalid_argument("unknown hint " + string(name));
+        }
+        s = i == string_view::npos ? string_view() : s.substr(i + 1);
     }
+    return result;
+}
 
-    cerr << "aggregate: load_factor " << result.load_factor() << endl;
+// Longest line accepted where input is read in pieces.
+constexpr size_t max_line_size = 4096;
 
-    return result;
+const size_t page_size = sysconf(_SC_PAGESIZE);
+
+// A byte offset in the input, decompressed for compressed input, as in
+// errors.
+string input_position(const string& path, size_t offset)
+{
+    return path + ":" + to_string(offset);
 }
 
-} // namespace
+runtime_error input_error(const string& path, size_t offset, const string& what)
+{
+    return runtime_error(input_position(path, offset) + ": " + what);
+}
 
-int main(int argc, char** argv)
+// The lines which start in [begin, end) of a file, out of data read from
+// offset, which covers them up to the newline ending the last one.
+string_view lines_in(string_view data, size_t offset, size_t begin, size_t end, size_t file_size, const string& path)
 {
-    if (argc != 2) {
-        cerr << "usage: " << argv[0] << " file" << endl;
-        return 1;
+    size_t first = 0;
+    if (begin) {
+        first = data.find_first_of('\n', begin - 1 - offset);
+        first = first == string_view::npos ? data.size() : first + 1;
     }
+    size_t last = data.size();
+    if (end < file_size) {
+        last = data.find_first_of('\n', end - 1 - offset);
+        if (last != string_view::npos) {
+            ++last;
+        } else if (offset + data.size() == file_size) {
+            last = data.size(); // No newline at the end of file.
+        } else {
+            const auto start = data.find_last_of('\n', end - 1 - offset);
+            throw input_error(path, offset + (start == string_view::npos ? 0 : start + 1), "line too long");
+        }
+    }
+    return first < last ? data.substr(first, last - first) : string_view();
+}
 
-    mmap_file file { file_descr { argv[1] } };
-    string_view input { file };
-
-    const auto n_cpus = thread::hardware_concurrency();
-    const auto chunk_size = input.size() / n_cpus;
+// Part of a file mapped on its own: the lines which start in [begin, end).
+// With release, the pages are dropped from the page cache as well when the
+// window goes away, so that going through a large file doesn't push out
+// everything else.
+struct mmap_window {
+    mmap_window(const file_descr& fd, size_t file_size, size_t begin, size_t end, const map_hints& hints, bool release)
+        : fd_ { fd.fd_ }
+        , offset_ { (begin ? begin - 1 : 0) & ~(page_size - 1) }
+        , size_ { min(file_size, end + max_line_size) - offset_ }
+        , release_ { release }
+    {
+        const int flags = MAP_PRIVATE | (hints.populate ? MAP_POPULATE : 0);
+        void* data = mmap(nullptr, size_, PROT_READ, flags, fd_, offset_);
+        if (data == MAP_FAILED) {
+            throw runtime_error(strerror(errno));
+        }
+        data_ = static_cast<char*>(data);
+        if (hints.sequential) {
+            madvise(data_, size_, MADV_SEQUENTIAL);
+        }
+        if (hints.hugepage) {
+            madvise(data_, size_, MADV_HUGEPAGE);
+        }
 
-    future<unordered_statistics> partial[n_cpus];
+        lines_ = lines_in({ data_, size_ }, offset_, begin, end, file_size, fd.path());
+    }
 
-    for (unsigned i = 0; i < n_cpus - 1; ++i) {
-        const auto chunk_end = input.find_first_of('\n', chunk_size) + 1;
-        cerr << "Chunk " << (i + 1) << ", size " << chunk_end << endl;
-        partial[i] = async(launch::async, aggregate, input.substr(0, chunk_end));
-        input = input.substr(chunk_end);
+    ~mmap_window()
+    {
+        if (release_) {
+            madvise(data_, size_, MADV_DONTNEED);
+            posix_fadvise(fd_, offset_, size_, POSIX_FADV_DONTNEED);
+        }
+        if (munmap(data_, size_) == -1) {
+            cerr << "mmap_window: " << strerror(errno) << endl;
+        }
     }
-    cerr << "Chunk " << n_cpus << ", size " << input.size() << endl;
-    partial[n_cpus - 1] = async(launch::async, aggregate, input);
 
-    ordered_statistics result;
+    mmap_window(const mmap_window&) = delete;
+    mmap_window& operator=(const mmap_window&) = delete;
 
-    for (auto& part : partial) {
-        for (const auto& item : part.get()) {
-            if (auto it = result.find(item.first); it != result.end()) {
-                it->second.update(item.second);
+    operator const string_view() const
+    {
+        return lines_;
+    }
+
+    // In the file, of p in the lines.
+    size_t offset_of(const char* p) const
+    {
+        return offset_ + (p - data_);
+    }
+
+private:
+    int fd_;
+    size_t offset_;
+    size_t size_;
+    bool release_;
+    char* data_ {};
+    string_view lines_;
+};
+
+struct mmap_file {
+    mmap_file(const file_descr& fd, const map_hints& hints = {})
+    {
+        struct stat st;
+        if (fstat(fd.fd_, &st) == -1) {
+            throw runtime_error(strerror(errno));
+        }
+        size_ = st.st_size;
+        if (hints.fadvise && posix_fadvise(fd.fd_, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
+            cerr << "mmap_file: posix_fadvise failed" << endl;
+        }
+        if (hints.readahead && readahead(fd.fd_, 0, size_) == -1) {
+            cerr << "mmap_file: readahead: " << strerror(errno) << endl;
+        }
+        // Nothing to map, which mmap() refuses.
+        if (!size_) {
+            return;
+        }
+        const int flags = MAP_PRIVATE | (hints.populate ? MAP_POPULATE : 0);
+        void* data = mmap(nullptr, size_, PROT_READ, flags, fd.fd_, 0);
+        if (data == MAP_FAILED) {
+            throw runtime_error(strerror(errno));
+        }
+        data_ = static_cast<char*>(data);
+        if (hints.sequential) {
+            advise(MADV_SEQUENTIAL, "MADV_SEQUENTIAL");
+        }
+        if (hints.willneed) {
+            advise(MADV_WILLNEED, "MADV_WILLNEED");
+        }
+        if (hints.hugepage) {
+            advise(MADV_HUGEPAGE, "MADV_HUGEPAGE");
+        }
+    }
+
+    ~mmap_file()
+    {
+        if (data_ && munmap(data_, size_) == -1) {
+            cerr << "mmap_file: " << strerror(errno) << endl;
+        }
+    }
+
+    mmap_file(const mmap_file&) = delete;
+    mmap_file& operator=(const mmap_file&) = delete;
+
+    operator const string_view() const
+    {
+        return { data_, size_ };
+    }
+
+private:
+    void advise(int advice, const char* name)
+    {
+        if (madvise(data_, size_, advice) == -1) {
+            cerr << "mmap_file: " << name << ": " << strerror(errno) << endl;
+        }
+    }
+
+    char* data_ {};
+    size_t size_ {};
+};
+
+// Reads until the buffer is full or the end of file.
+size_t read_full(int fd, char* data, size_t capacity)
+{
+    size_t size = 0;
+    while (size < capacity) {
+        const auto n = read(fd, data + size, capacity - size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error(strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    return size;
+}
+
+//----------------------------------------------------------------------------
+// Streaming input, for pipes and other files which can't be mapped.
+
+template <typename T>
+struct bounded_queue {
+    explicit bounded_queue(size_t capacity)
+        : capacity_ { capacity }
+    {
+    }
+
+    // Blocks while the queue is full. False if the queue is closed.
+    bool push(T x)
+    {
+        unique_lock lock { mutex_ };
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(move(x));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. Nothing once it's closed and drained.
+    optional<T> pop()
+    {
+        unique_lock lock { mutex_ };
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        return take();
+    }
+
+    optional<T> try_pop()
+    {
+        lock_guard lock { mutex_ };
+        return take();
+    }
+
+    void close()
+    {
+        lock_guard lock { mutex_ };
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    bool closed()
+    {
+        lock_guard lock { mutex_ };
+        return closed_;
+    }
+
+private:
+    optional<T> take()
+    {
+        if (items_.empty()) {
+            return {};
+        }
+        T x = move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return x;
+    }
+
+    mutex mutex_;
+    condition_variable not_empty_;
+    condition_variable not_full_;
+    deque<T> items_;
+    size_t capacity_;
+    bool closed_ {};
+};
+
+struct stream_buffer {
+    // Room in front of the data for the incomplete line carried over from
+    // the previous buffer, which bounds the length of a line. Also keeps
+    // the data aligned for O_DIRECT.
+    static constexpr size_t carry_capacity = max_line_size;
+
+    stream_buffer(size_t index, size_t capacity)
+        : index { index }
+        , storage_ { static_cast<char*>(aligned_alloc(carry_capacity, carry_capacity + capacity)) }
+        , capacity_ { capacity }
+    {
+        if (!storage_) {
+            throw bad_alloc();
+        }
+    }
+
+    ~stream_buffer()
+    {
+        free(storage_);
+    }
+
+    stream_buffer(const stream_buffer&) = delete;
+    stream_buffer& operator=(const stream_buffer&) = delete;
+
+    char* data()
+    {
+        return storage_ + carry_capacity;
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    const size_t index;
+
+    // Complete lines, including the carried over one.
+    string_view lines;
+    size_t offset {}; // Of the lines in the input.
+
+private:
+    char* storage_;
+    size_t capacity_;
+};
+
+// A fixed set of buffers, filled in order by a reader thread and handed out
+// to parsers, so that parsing overlaps reading.
+struct buffered_input {
+    buffered_input(const string& path, size_t buffer_size, size_t n_buffers)
+        : free_ { n_buffers }
+        , filled_ { n_buffers }
+        , path_ { path }
+    {
+        for (size_t i = 0; i < n_buffers; ++i) {
+            buffers_.push_back(make_unique<stream_buffer>(i, buffer_size));
+            free_.push(buffers_.back().get());
+        }
+    }
+
+    virtual ~buffered_input() = default;
+
+    buffered_input(const buffered_input&) = delete;
+    buffered_input& operator=(const buffered_input&) = delete;
+
+    // Next filled buffer, nothing at the end of input.
+    stream_buffer* next()
+    {
+        return filled_.pop().value_or(nullptr);
+    }
+
+    void release(stream_buffer* b)
+    {
+        free_.push(b);
+    }
+
+    const string& path() const
+    {
+        return path_;
+    }
+
+    // Stops reading early, on parser failure.
+    void abort()
+    {
+        free_.close();
+        filled_.close();
+    }
+
+    // Waits for the reader, throws its error.
+    void finish()
+    {
+        reader_.join();
+        if (error_) {
+            rethrow_exception(error_);
+        }
+    }
+
+protected:
+    // Derived constructors start the reader, and derived destructors stop
+    // it before their members go away.
+    void start()
+    {
+        reader_ = thread { [this] {
+            try {
+                read_all();
+            } catch (...) {
+                error_ = current_exception();
+            }
+            filled_.close();
+        } };
+    }
+
+    void stop()
+    {
+        abort();
+        if (reader_.joinable()) {
+            reader_.join();
+        }
+    }
+
+    virtual void read_all() = 0;
+
+    // Publishes n bytes read into the data of the buffer, after the line
+    // carried over from the previous one.
+    void deliver(stream_buffer* b, size_t n)
+    {
+        char* const begin = b->data() - carry_.size();
+        memcpy(begin, carry_.data(), carry_.size());
+        const string_view text { begin, carry_.size() + n };
+        const auto offset = delivered_ - carry_.size();
+        delivered_ += n;
+        const auto last = text.find_last_of('\n');
+        const auto tail = last == string_view::npos ? text : text.substr(last + 1);
+        if (tail.size() > stream_buffer::carry_capacity) {
+            throw input_error(path_, offset + text.size() - tail.size(), "line too long");
+        }
+        carry_.assign(tail);
+        if (last == string_view::npos) {
+            free_.push(b);
+        } else {
+            b->lines = text.substr(0, last + 1);
+            b->offset = offset;
+            filled_.push(b);
+        }
+    }
+
+    // Publishes the last line if it lacks the newline.
+    void deliver_last()
+    {
+        if (carry_.empty()) {
+            return;
+        }
+        if (const auto b = free_.pop()) {
+            char* const begin = (*b)->data() - carry_.size();
+            memcpy(begin, carry_.data(), carry_.size());
+            (*b)->lines = { begin, carry_.size() };
+            (*b)->offset = delivered_ - carry_.size();
+            filled_.push(*b);
+        }
+    }
+
+    vector<unique_ptr<stream_buffer>> buffers_;
+    bounded_queue<stream_buffer*> free_;
+    bounded_queue<stream_buffer*> filled_;
+
+private:
+    string path_;
+    size_t delivered_ {}; // Bytes read.
+    string carry_;
+    thread reader_;
+    exception_ptr error_;
+};
+
+constexpr size_t stream_buffer_size = 8 << 20;
+
+// Buffers of a buffered input, n of size bytes, fewer and then smaller to
+// stay within a budget, unless it is 0.
+pair<size_t, size_t> buffer_plan(size_t size, size_t n, size_t budget)
+{
+    if (budget) {
+        n = clamp<size_t>(budget / size, 2, n);
+        size = clamp<size_t>(budget / n & ~(page_size - 1), 64 << 10, size);
+    }
+    return { size, n };
+}
+
+// Plain read(2) into the buffers.
+struct stream_input : buffered_input {
+    stream_input(const file_descr& fd, size_t buffer_size, size_t n_buffers)
+        : buffered_input { fd.path(), buffer_size, n_buffers }
+        , fd_ { fd.fd_ }
+    {
+        start();
+    }
+
+    ~stream_input() override
+    {
+        stop();
+    }
+
+private:
+    void read_all() override
+    {
+        while (const auto b = free_.pop()) {
+            const auto n = read_full(fd_, (*b)->data(), (*b)->capacity());
+            if (n == 0) {
+                free_.push(*b);
+                break;
+            }
+            deliver(*b, n);
+        }
+        deliver_last();
+    }
+
+    int fd_;
+};
+
+//----------------------------------------------------------------------------
+// Direct input with io_uring, bypassing the page cache.
+
+// Just enough of io_uring on top of the raw system calls: one submitter,
+// one reaper, both the same thread.
+struct uring {
+    explicit uring(unsigned entries)
+    {
+        io_uring_params p {};
+        fd_ = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd_ == -1) {
+            throw runtime_error(string("io_uring_setup: ") + strerror(errno));
+        }
+        sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size_ = cq_size_ = max(sq_size_, cq_size_);
+        }
+        sq_ = map(sq_size_, IORING_OFF_SQ_RING);
+        cq_ = p.features & IORING_FEAT_SINGLE_MMAP ? sq_ : map(cq_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+        sq_tail_ = at<unsigned>(sq_, p.sq_off.tail);
+        sq_mask_ = *at<unsigned>(sq_, p.sq_off.ring_mask);
+        sq_array_ = at<unsigned>(sq_, p.sq_off.array);
+        cq_head_ = at<unsigned>(cq_, p.cq_off.head);
+        cq_tail_ = at<unsigned>(cq_, p.cq_off.tail);
+        cq_mask_ = *at<unsigned>(cq_, p.cq_off.ring_mask);
+        cqes_ = at<io_uring_cqe>(cq_, p.cq_off.cqes);
+    }
+
+    ~uring()
+    {
+        munmap(sqes_, sqes_size_);
+        if (cq_ != sq_) {
+            munmap(cq_, cq_size_);
+        }
+        munmap(sq_, sq_size_);
+        close(fd_);
+    }
+
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+
+    bool register_buffers(const vector<iovec>& iov)
+    {
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+    }
+
+    // Queues a read into registered buffer index, or a plain one without.
+    void read(int fd, char* data, unsigned size, uint64_t offset, optional<unsigned> index, uint64_t tag)
+    {
+        const unsigned tail = *sq_tail_;
+        const unsigned i = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[i];
+        sqe = {};
+        sqe.opcode = index ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.buf_index = index.value_or(0);
+        sqe.user_data = tag;
+        sq_array_[i] = i;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted_;
+    }
+
+    // Submits the queued reads and waits for at least wait completions.
+    void submit(unsigned wait)
+    {
+        for (;;) {
+            const auto n = syscall(__NR_io_uring_enter, fd_, unsubmitted_, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                unsubmitted_ -= n;
+                return;
+            }
+            if (errno != EINTR) {
+                throw runtime_error(string("io_uring_enter: ") + strerror(errno));
+            }
+        }
+    }
+
+    // Takes the next completion, if there is one.
+    bool complete(uint64_t& tag, int& result)
+    {
+        const unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        tag = cqes_[head & cq_mask_].user_data;
+        result = cqes_[head & cq_mask_].res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    void* map(size_t size, off_t offset)
+    {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (p == MAP_FAILED) {
+            throw runtime_error(strerror(errno));
+        }
+        return p;
+    }
+
+    template <typename T>
+    static T* at(void* base, unsigned offset)
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    int fd_ { -1 };
+    void* sq_ {};
+    void* cq_ {};
+    io_uring_sqe* sqes_ {};
+    size_t sq_size_ {};
+    size_t cq_size_ {};
+    size_t sqes_size_ {};
+    unsigned* sq_tail_ {};
+    unsigned sq_mask_ {};
+    unsigned* sq_array_ {};
+    unsigned* cq_head_ {};
+    unsigned* cq_tail_ {};
+    unsigned cq_mask_ {};
+    io_uring_cqe* cqes_ {};
+    unsigned unsubmitted_ {};
+};
+
+constexpr size_t uring_block_size = 4 << 20;
+constexpr unsigned uring_depth = 16;
+
+// Keeps many O_DIRECT reads of consecutive blocks in flight, and delivers
+// the blocks in file order as they complete.
+struct uring_input : buffered_input {
+    uring_input(const file_descr& fd, size_t block_size, size_t n_buffers)
+        : buffered_input { fd.path(), block_size, n_buffers }
+        , fd_ { open_direct(fd) }
+        , ring_ { uring_depth }
+        , size_ { fd_.size() }
+        , block_size_ { block_size }
+    {
+        vector<iovec> iov;
+        for (const auto& b : buffers_) {
+            iov.push_back({ b->data(), b->capacity() });
+        }
+        registered_ = ring_.register_buffers(iov);
+        if (!registered_) {
+            cerr << "uring_input: IORING_REGISTER_BUFFERS: " << strerror(errno) << endl;
+        }
+        start();
+    }
+
+    ~uring_input() override
+    {
+        stop();
+    }
+
+private:
+    struct block {
+        stream_buffer* buffer;
+        size_t size; // Expected, short only at the end of file.
+        size_t filled;
+        bool done;
+    };
+
+    void read_all() override
+    {
+        const size_t n_blocks = (size_ + block_size_ - 1) / block_size_;
+        size_t submitted = 0;
+        size_t delivered = 0;
+        deque<block> in_flight;
+
+        while (delivered < n_blocks) {
+            while (submitted < n_blocks && in_flight.size() < uring_depth) {
+                const auto b = in_flight.empty() ? free_.pop() : free_.try_pop();
+                if (!b) {
+                    break;
+                }
+                const auto offset = submitted * block_size_;
+                in_flight.push_back({ *b, min(block_size_, size_ - offset), 0, false });
+                read(submitted, in_flight.back());
+                ++submitted;
+            }
+            if (in_flight.empty()) {
+                return; // Aborted.
+            }
+            ring_.submit(1);
+            uint64_t tag;
+            int result;
+            while (ring_.complete(tag, result)) {
+                auto& blk = in_flight[tag - delivered];
+                if (result < 0) {
+                    throw runtime_error(string("uring_input: ") + strerror(-result));
+                }
+                blk.filled += result;
+                if (result == 0 || blk.filled >= blk.size) {
+                    blk.done = true;
+                } else {
+                    read(tag, blk); // Short read, the rest of it.
+                }
+            }
+            while (!in_flight.empty() && in_flight.front().done) {
+                deliver(in_flight.front().buffer, in_flight.front().filled);
+                in_flight.pop_front();
+                ++delivered;
+            }
+        }
+        deliver_last();
+    }
+
+    static file_descr open_direct(const file_descr& fd)
+    {
+        try {
+            return fd.reopen(O_RDONLY | O_DIRECT);
+        } catch (const runtime_error& e) {
+            cerr << "uring_input: O_DIRECT: " << e.what() << ", reading through the page cache" << endl;
+            return fd.reopen(O_RDONLY);
+        }
+    }
+
+    // Rest of the block, rounded up to the alignment of O_DIRECT.
+    void read(size_t i, const block& blk)
+    {
+        const auto offset = i * block_size_ + blk.filled;
+        const auto size = blk.buffer->capacity() - blk.filled;
+        optional<unsigned> index;
+        if (registered_) {
+            index = blk.buffer->index;
+        }
+        ring_.read(fd_.fd_, blk.buffer->data() + blk.filled, size, offset, index, i);
+    }
+
+    file_descr fd_;
+    uring ring_;
+    size_t size_;
+    size_t block_size_;
+    bool registered_ {};
+};
+
+//----------------------------------------------------------------------------
+// Compressed input.
+
+enum class codec { none, gzip, zstd, lz4 };
+
+codec detect_codec(const file_descr& fd)
+{
+    unsigned char magic[4] {};
+    if (fd.read_at(reinterpret_cast<char*>(magic), sizeof(magic), 0) < sizeof(magic)) {
+        return codec::none;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        return codec::gzip;
+    }
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return codec::zstd;
+    }
+    if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18) {
+        return codec::lz4;
+    }
+    return codec::none;
+}
+
+// Streaming decompressor, fed with compressed input in pieces.
+struct stream_decoder {
+    virtual ~stream_decoder() = default;
+
+    // Decodes as much as fits into [out, out_end), advancing in and out.
+    virtual void decode(string_view& in, char*& out, char* out_end) = 0;
+
+    // Throws if the input ended in the middle of a frame.
+    virtual void end() = 0;
+};
+
+// Also handles files of several gzip members, as written by pigz or cat.
+struct gzip_decoder : stream_decoder {
+    gzip_decoder()
+    {
+        if (inflateInit2(&z_, 15 + 16) != Z_OK) {
+            throw runtime_error("gzip_decoder: inflateInit2 failed");
+        }
+    }
+
+    ~gzip_decoder() override
+    {
+        inflateEnd(&z_);
+    }
+
+    void decode(string_view& in, char*& out, char* out_end) override
+    {
+        if (in.empty()) {
+            return;
+        }
+        if (ended_) {
+            inflateReset(&z_);
+            ended_ = false;
+        }
+        z_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        z_.avail_in = in.size();
+        z_.next_out = reinterpret_cast<Bytef*>(out);
+        z_.avail_out = out_end - out;
+        const int rc = inflate(&z_, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            ended_ = true;
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            throw runtime_error(string("gzip_decoder: ") + (z_.msg ? z_.msg : "inflate failed"));
+        }
+        in.remove_prefix(in.size() - z_.avail_in);
+        out = reinterpret_cast<char*>(z_.next_out);
+    }
+
+    void end() override
+    {
+        if (!ended_) {
+            throw runtime_error("gzip_decoder: unexpected end of input");
+        }
+    }
+
+private:
+    z_stream z_ {};
+    bool ended_ {};
+};
+
+#ifdef ONEBRC_ZSTD
+struct zstd_decoder : stream_decoder {
+    zstd_decoder()
+        : stream_ { ZSTD_createDStream() }
+    {
+        if (!stream_) {
+            throw bad_alloc();
+        }
+    }
+
+    ~zstd_decoder() override
+    {
+        ZSTD_freeDStream(stream_);
+    }
+
+    void decode(string_view& in, char*& out, char* out_end) override
+    {
+        ZSTD_inBuffer src { in.data(), in.size(), 0 };
+        ZSTD_outBuffer dst { out, static_cast<size_t>(out_end - out), 0 };
+        const auto rc = ZSTD_decompressStream(stream_, &dst, &src);
+        if (ZSTD_isError(rc)) {
+            throw runtime_error(string("zstd_decoder: ") + ZSTD_getErrorName(rc));
+        }
+        ended_ = rc == 0;
+        in.remove_prefix(src.pos);
+        out += dst.pos;
+    }
+
+    void end() override
+    {
+        if (!ended_) {
+            throw runtime_error("zstd_decoder: unexpected end of input");
+        }
+    }
+
+private:
+    ZSTD_DStream* stream_;
+    bool ended_ { true };
+};
+#endif
+
+#ifdef ONEBRC_LZ4
+struct lz4_decoder : stream_decoder {
+    lz4_decoder()
+    {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&context_, LZ4F_VERSION))) {
+            throw bad_alloc();
+        }
+    }
+
+    ~lz4_decoder() override
+    {
+        LZ4F_freeDecompressionContext(context_);
+    }
+
+    void decode(string_view& in, char*& out, char* out_end) override
+    {
+        size_t src_size = in.size();
+        size_t dst_size = out_end - out;
+        const auto rc = LZ4F_decompress(context_, out, &dst_size, in.data(), &src_size, nullptr);
+        if (LZ4F_isError(rc)) {
+            throw runtime_error(string("lz4_decoder: ") + LZ4F_getErrorName(rc));
+        }
+        ended_ = rc == 0;
+        in.remove_prefix(src_size);
+        out += dst_size;
+    }
+
+    void end() override
+    {
+        if (!ended_) {
+            throw runtime_error("lz4_decoder: unexpected end of input");
+        }
+    }
+
+private:
+    LZ4F_dctx* context_ {};
+    bool ended_ { true };
+};
+#endif
+
+unique_ptr<stream_decoder> make_decoder(codec c)
+{
+    switch (c) {
+    case codec::gzip:
+        return make_unique<gzip_decoder>();
+#ifdef ONEBRC_ZSTD
+    case codec::zstd:
+        return make_unique<zstd_decoder>();
+#endif
+#ifdef ONEBRC_LZ4
+    case codec::lz4:
+        return make_unique<lz4_decoder>();
+#endif
+    default:
+        throw runtime_error("make_decoder: compression not supported by this build");
+    }
+}
+
+// A single decompressor thread feeding the parsers.
+struct decompress_input : buffered_input {
+    decompress_input(const file_descr& fd, codec c, size_t buffer_size, size_t n_buffers)
+        : buffered_input { fd.path(), buffer_size, n_buffers }
+        , fd_ { fd.fd_ }
+        , decoder_ { make_decoder(c) }
+    {
+        start();
+    }
+
+    ~decompress_input() override
+    {
+        stop();
+    }
+
+private:
+    void read_all() override
+    {
+        vector<char> compressed(1 << 20);
+        string_view in;
+        bool eof = false;
+
+        while (const auto b = free_.pop()) {
+            char* out = (*b)->data();
+            char* const out_end = out + (*b)->capacity();
+            while (out < out_end) {
+                if (in.empty() && !eof) {
+                    const auto n = read_full(fd_, compressed.data(), compressed.size());
+                    eof = n == 0;
+                    in = { compressed.data(), n };
+                }
+                if (in.empty() && eof) {
+                    break;
+                }
+                decoder_->decode(in, out, out_end);
+            }
+            const size_t n = out - (*b)->data();
+            if (n == 0) {
+                free_.push(*b);
+                break;
+            }
+            deliver(*b, n);
+        }
+        decoder_->end();
+        deliver_last();
+    }
+
+    int fd_;
+    unique_ptr<stream_decoder> decoder_;
+};
+
+// Compressed bytes of a frame walked to find where it ends, beyond which the
+// rest of the file is taken for a single frame. Frames don't have their size
+// up front, and walking all of a large one would read it twice.
+constexpr size_t frame_probe_size = 64 << 20;
+
+#if defined(ONEBRC_ZSTD) || defined(ONEBRC_LZ4)
+// Little-endian, at i of data which has it.
+uint32_t le32_at(string_view data, size_t i)
+{
+    uint32_t x;
+    memcpy(&x, data.data() + i, sizeof(x));
+    return le32toh(x);
+}
+#endif
+
+#ifdef ONEBRC_ZSTD
+// Frames listed by the seek table which ends a file in the zstd seekable
+// format, nothing without a valid one. The table is a skippable frame of
+// its own, followed by the number of frames, a descriptor and a magic
+// number, and lists the compressed size of each frame, then the size
+// decompressed and with the checksum flag of the descriptor a checksum.
+vector<string_view> seek_table_frames(string_view input)
+{
+    constexpr size_t footer_size = 9;
+    constexpr size_t skippable_header_size = 8;
+    if (input.size() < skippable_header_size + footer_size || le32_at(input, input.size() - 4) != 0x8f92eab1) {
+        return {};
+    }
+    const size_t n = le32_at(input, input.size() - footer_size);
+    const size_t entry_size = input[input.size() - 5] & 0x80 ? 12 : 8;
+    if (n > (input.size() - skippable_header_size - footer_size) / entry_size) {
+        return {};
+    }
+    const auto table_size = skippable_header_size + n * entry_size + footer_size;
+    const auto table = input.size() - table_size;
+    if (le32_at(input, table) != 0x184d2a5e || le32_at(input, table + 4) != table_size - skippable_header_size) {
+        return {};
+    }
+    vector<string_view> frames;
+    size_t offset = 0;
+    for (size_t k = 0; k < n; ++k) {
+        const size_t size = le32_at(input, table + skippable_header_size + k * entry_size);
+        if (size > table - offset) {
+            return {};
+        }
+        frames.push_back(input.substr(offset, size));
+        offset += size;
+    }
+    return offset == table ? frames : vector<string_view>();
+}
+#endif
+
+// Offsets of the independent frames of a zstd or lz4 file. Empty if it has
+// none, the format isn't supported by this build, or a frame doesn't end
+// within frame_probe_size: like the single frame both command line tools
+// write by default, which would be read through only to find its end.
+vector<string_view> find_frames([[maybe_unused]] string_view input, codec c)
+{
+    vector<string_view> frames;
+    switch (c) {
+#ifdef ONEBRC_ZSTD
+    case codec::zstd:
+        if (auto listed = seek_table_frames(input); !listed.empty()) {
+            return listed;
+        }
+        while (!input.empty()) {
+            const auto probe = input.substr(0, frame_probe_size);
+            const auto n = ZSTD_findFrameCompressedSize(probe.data(), probe.size());
+            if (ZSTD_isError(n)) {
+                if (probe.size() < input.size()) {
+                    return {};
+                }
+                throw runtime_error(string("find_frames: ") + ZSTD_getErrorName(n));
+            }
+            frames.push_back(input.substr(0, n));
+            input.remove_prefix(n);
+        }
+        break;
+#endif
+#ifdef ONEBRC_LZ4
+    case codec::lz4: {
+        const auto u32 = [&](size_t i) {
+            if (i + 4 > input.size()) {
+                throw runtime_error("find_frames: truncated lz4 frame");
+            }
+            return le32_at(input, i);
+        };
+        while (!input.empty()) {
+            const auto magic = u32(0);
+            size_t i = 4;
+            if ((magic & 0xfffffff0) == 0x184d2a50) { // Skippable frame.
+                i += 4 + u32(4);
+            } else if (magic == 0x184d2204) {
+                if (i + 2 > input.size()) {
+                    throw runtime_error("find_frames: truncated lz4 frame");
+                }
+                const auto flags = static_cast<unsigned char>(input[i]);
+                const bool block_checksum = flags & 0x10;
+                const bool content_size = flags & 0x08;
+                const bool content_checksum = flags & 0x04;
+                const bool dict_id = flags & 0x01;
+                i += 2 + (content_size ? 8 : 0) + (dict_id ? 4 : 0) + 1;
+                while (const auto block = u32(i)) {
+                    i += 4 + (block & 0x7fffffff) + (block_checksum ? 4 : 0);
+                    if (i > frame_probe_size) {
+                        return {};
+                    }
+                }
+                i += 4 + (content_checksum ? 4 : 0);
+            } else {
+                throw runtime_error("find_frames: not an lz4 frame");
+            }
+            if (i > input.size()) {
+                throw runtime_error("find_frames: truncated lz4 frame");
+            }
+            frames.push_back(input.substr(0, i));
+            input.remove_prefix(i);
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    return frames;
+}
+
+// Frames decompressed in parallel by the parsers themselves. Lines split
+// between frames are put back together by stitch() at the end.
+struct framed_input {
+    framed_input(const file_descr& fd, codec c)
+        : path_ { fd.path() }
+        , file_ { fd }
+        , codec_ { c }
+        , frames_ { find_frames(file_, c) }
+        , fragments_(frames_.size())
+    {
+    }
+
+    size_t size() const
+    {
+        return frames_.size();
+    }
+
+    const string& path() const
+    {
+        return path_;
+    }
+
+    unique_ptr<stream_decoder> decoder() const
+    {
+        return make_decoder(codec_);
+    }
+
+    // Complete lines of the next frame, decompressed into out, and the
+    // index of the frame. Nothing at the end of input.
+    optional<string_view> next(stream_decoder& decoder, vector<char>& out, size_t& frame)
+    {
+        const auto k = next_++;
+        if (k >= frames_.size()) {
+            return {};
+        }
+        frame = k;
+
+        string_view in = frames_[k];
+        if (out.empty()) {
+            out.resize(4 * in.size());
+        }
+        char* p = out.data();
+        do {
+            if (p == out.data() + out.size()) {
+                const auto n = p - out.data();
+                out.resize(2 * out.size());
+                p = out.data() + n;
+            }
+            decoder.decode(in, p, out.data() + out.size());
+        } while (!in.empty() || p == out.data() + out.size());
+        decoder.end();
+
+        const string_view text { out.data(), static_cast<size_t>(p - out.data()) };
+        auto& f = fragments_[k];
+        const auto first = text.find_first_of('\n');
+        if (first == string_view::npos) {
+            f.tail = text;
+            return string_view();
+        }
+        const auto last = text.find_last_of('\n');
+        f.has_newline = true;
+        f.head = text.substr(0, first);
+        f.tail = text.substr(last + 1);
+        return text.substr(first + 1, last - first);
+    }
+
+    // Lines which span frames, once all frames are done.
+    string stitch() const
+    {
+        string lines;
+        string carry;
+        for (const auto& f : fragments_) {
+            if (f.has_newline) {
+                carry += f.head;
+                if (!carry.empty()) {
+                    lines += carry;
+                    lines += '\n';
+                }
+                carry = f.tail;
+            } else {
+                carry += f.tail;
+            }
+        }
+        if (!carry.empty()) {
+            lines += carry;
+            lines += '\n';
+        }
+        return lines;
+    }
+
+private:
+    struct fragment {
+        bool has_newline {};
+        string head; // Before the first newline.
+        string tail; // After the last newline, the whole frame without one.
+    };
+
+    string path_;
+    mmap_file file_;
+    codec codec_;
+    vector<string_view> frames_;
+    vector<fragment> fragments_;
+    atomic<size_t> next_ {};
+};
+
+//----------------------------------------------------------------------------
+// Input backends. However the input gets read, parsers see it as pieces of
+// whole lines.
+
+// One for each parser.
+struct input_reader {
+    virtual ~input_reader() = default;
+
+    // Next piece of whole lines, and the table it goes to. Invalidates the
+    // previous piece. False at the end of input.
+    virtual bool next(string_view& lines, size_t& slot) = 0;
+
+    // Path and offset of p in the current piece, for errors.
+    virtual string where(const char* p) const = 0;
+};
+
+struct input_backend {
+    virtual ~input_backend() = default;
+
+    // For a parser on a NUMA node, see range_queue.
+    virtual unique_ptr<input_reader> reader(unsigned node) = 0;
+
+    // Whether the pieces stay mapped for the whole run, so that prefetchers
+    // can read ahead of the parsers in them.
+    virtual bool prefetchable() const
+    {
+        return false;
+    }
+
+    // Called once the readers are done. Throws errors of background threads,
+    // returns lines none of the readers saw whole.
+    virtual string finish()
+    {
+        return {};
+    }
+
+    // Where the lines finish() returns come from, for errors.
+    virtual string where() const
+    {
+        return {};
+    }
+};
+
+// A regular file read in parts.
+struct ranged_file {
+    const file_descr* fd;
+    size_t size;
+    size_t slot;
+};
+
+// Part of a ranged_file: the lines which start in [begin, end).
+struct file_range {
+    const ranged_file* file;
+    size_t begin;
+    size_t end;
+};
+
+// How ranged files are cut for the parsers.
+struct chunking {
+    size_t max_size; // Of a range.
+    bool adaptive; // Sized by how fast each parser goes, see range_queue.
+    vector<unsigned> node_parsers; // By NUMA node.
+};
+
+// Smallest range an adaptive range_queue hands out.
+constexpr size_t min_range_size = 64 << 10;
+
+// Ranges of the files taken by the readers in turn, cut as they are taken.
+//
+// With NUMA nodes, each node with parsers has a contiguous share of the
+// bytes, in proportion to its parsers, so that the pages of a share are
+// faulted in or read on the node which parses them. Readers go on with the
+// shares of the other nodes once theirs is done.
+//
+// Adaptive ranges are sized for each reader by how fast it got through its
+// ranges before: a share of the bytes left which is in proportion to its
+// part of the total rate, halved so that later ranges can make up for the
+// estimates. They get smaller towards the end, so that parsers on slower
+// cores, or with less of the machine, finish about when the others do.
+struct range_queue {
+    range_queue(const vector<ranged_file>& files, const chunking& how)
+        : files_ { files }
+        , how_ { how }
+        , share_of_(how.node_parsers.size())
+        , start_ { steady_clock::now() }
+    {
+        size_t offset = 0;
+        for (const auto& f : files) {
+            offsets_.push_back(offset);
+            offset += f.size;
+        }
+        // One share of all of it without parsers by node.
+        size_t n_shares = 0;
+        size_t parsers = 0;
+        for (const auto n : how.node_parsers) {
+            n_shares += n != 0;
+            parsers += n;
+        }
+        shares_ = vector<share>(max<size_t>(1, n_shares));
+        shares_[0].next = 0;
+        shares_[0].end = offset;
+        size_t before = 0;
+        for (unsigned node = 0, k = 0; node < how.node_parsers.size(); ++node) {
+            if (how.node_parsers[node]) {
+                share_of_[node] = k;
+                shares_[k].next = offset * before / parsers;
+                before += how.node_parsers[node];
+                shares_[k++].end = offset * before / parsers;
+            }
+        }
+        left_ = offset;
+    }
+
+    // Takes the ranges of a reader, and measures how fast it goes.
+    struct taker {
+        taker(range_queue& queue, unsigned node)
+            : queue_ { queue }
+            , share_ { node < queue.share_of_.size() ? queue.share_of_[node] : 0 }
+        {
+        }
+
+        ~taker()
+        {
+            queue_.total_rate_ -= rate_;
+        }
+
+        optional<file_range> next()
+        {
+            const auto now = steady_clock::now();
+            if (taken_) {
+                const auto rate = taken_ / duration<double>(now - last_).count();
+                const auto average = rate_ ? (rate_ + rate) / 2 : rate;
+                queue_.total_rate_ += average - rate_;
+                rate_ = average;
+            }
+            const auto r = queue_.take(share_, rate_);
+            if (r) {
+                taken_ = r->end - r->begin;
+                last_ = now;
+            } else if (rate_) {
+                queue_.finished(now);
+            }
+            return r;
+        }
+
+    private:
+        range_queue& queue_;
+        unsigned share_; // Of its node, taken first.
+        double rate_ {}; // Bytes per second, 0 until known.
+        size_t taken_ {};
+        steady_clock::time_point last_;
+    };
+
+    // Ranges handed out, their sizes, and how far apart in time the readers
+    // which got any ran out of them.
+    void report() const
+    {
+        lock_guard lock(mutex_);
+        if (!n_ranges_) {
+            return;
+        }
+        const auto spread = duration<double>(last_finish_ - first_finish_).count();
+        const auto total = duration<double>(last_finish_ - start_).count();
+        cerr << "ranges: " << n_ranges_ << " of " << min_size_ << " to " << max_size_ << " bytes, parsers done within "
+             << spread * 1000 << " ms of each other in " << total * 1000 << " ms" << endl;
+    }
+
+private:
+    size_t range_size(double rate) const
+    {
+        if (!how_.adaptive || !rate) {
+            return how_.max_size;
+        }
+        const auto total = max(total_rate_.load(), rate);
+        return clamp<size_t>(left_ * (rate / total) / 2, min(min_range_size, how_.max_size), how_.max_size);
+    }
+
+    optional<file_range> take(unsigned first, double rate)
+    {
+        const auto size = range_size(rate);
+        for (size_t k = 0; k < shares_.size(); ++k) {
+            auto& share = shares_[(first + k) % shares_.size()];
+            auto begin = share.next.load(memory_order_relaxed);
+            while (begin < share.end) {
+                // Not across files, which end ranges early.
+                const auto i = upper_bound(offsets_.begin(), offsets_.end(), begin) - offsets_.begin() - 1;
+                const auto end = min({ begin + size, share.end, offsets_[i] + files_[i].size });
+                if (share.next.compare_exchange_weak(begin, end, memory_order_relaxed)) {
+                    left_ -= end - begin;
+                    count(end - begin);
+                    return file_range { &files_[i], begin - offsets_[i], end - offsets_[i] };
+                }
+            }
+        }
+        return nullopt;
+    }
+
+    void count(size_t size)
+    {
+        lock_guard lock(mutex_);
+        min_size_ = n_ranges_++ ? min(min_size_, size) : size;
+        max_size_ = max(max_size_, size);
+    }
+
+    void finished(steady_clock::time_point when)
+    {
+        lock_guard lock(mutex_);
+        first_finish_ = n_finished_++ ? min(first_finish_, when) : when;
+        last_finish_ = max(last_finish_, when);
+    }
+
+    // Bytes of the files laid end to end.
+    struct alignas(64) share {
+        atomic<size_t> next;
+        size_t end;
+    };
+
+    const vector<ranged_file>& files_;
+    const chunking how_;
+    vector<size_t> offsets_; // Of the files.
+    vector<share> shares_;
+    vector<unsigned> share_of_; // By node.
+    atomic<size_t> left_;
+    atomic<double> total_rate_ { 0 }; // Of the readers with a rate.
+
+    mutable mutex mutex_;
+    steady_clock::time_point start_;
+    steady_clock::time_point first_finish_;
+    steady_clock::time_point last_finish_;
+    size_t n_ranges_ {};
+    size_t n_finished_ {};
+    size_t min_size_ {};
+    size_t max_size_ {};
+};
+
+// Files mapped whole. The parsers take ranges of them in turn and find
+// the line boundaries themselves, so nothing is read up front.
+struct mmap_backend : input_backend {
+    mmap_backend(const vector<ranged_file>& files, const map_hints& hints, const chunking& how)
+        : files_ { files.data() }
+        , ranges_ { files, how }
+    {
+        for (const auto& f : files) {
+            mapped_.push_back(make_unique<mmap_file>(*f.fd, hints));
+        }
+        cerr << "mmap_backend: " << files.size() << " files in chunks of up to " << how.max_size << endl;
+    }
+
+    unique_ptr<input_reader> reader(unsigned node) override
+    {
+        return make_unique<chunk_reader>(*this, node);
+    }
+
+    bool prefetchable() const override
+    {
+        return true;
+    }
+
+    string finish() override
+    {
+        ranges_.report();
+        return {};
+    }
+
+private:
+    struct chunk_reader : input_reader {
+        chunk_reader(mmap_backend& backend, unsigned node)
+            : backend_ { backend }
+            , ranges_ { backend.ranges_, node }
+        {
+        }
+
+        bool next(string_view& lines, size_t& slot) override
+        {
+            while (const auto r = ranges_.next()) {
+                file_ = r->file;
+                mapped_ = *backend_.mapped_[r->file - backend_.files_];
+                lines = lines_in(mapped_, 0, r->begin, r->end, r->file->size, r->file->fd->path());
+                slot = r->file->slot;
+                if (!lines.empty()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        string where(const char* p) const override
+        {
+            return input_position(file_->fd->path(), p - mapped_.data());
+        }
+
+    private:
+        mmap_backend& backend_;
+        range_queue::taker ranges_;
+        const ranged_file* file_ {};
+        string_view mapped_;
+    };
+
+    const ranged_file* files_; // Mapped in the same order.
+    range_queue ranges_;
+    vector<unique_ptr<mmap_file>> mapped_;
+};
+
+// Each parser maps a range at a time, see mmap_window. Page faults are
+// then taken on mappings of its own rather than on one shared by all of
+// them, and populating a mapping is done by the parser which reads it.
+struct window_backend : input_backend {
+    // At most max_windows mapped at a time, any number with 0.
+    window_backend(const vector<ranged_file>& files, const map_hints& hints, const chunking& how, bool release, size_t max_windows)
+        : ranges_ { files, how }
+        , hints_ { hints }
+        , release_ { release }
+        , max_windows_ { max_windows }
+    {
+        cerr << "window_backend: " << files.size() << " files in windows of up to " << how.max_size;
+        if (max_windows) {
+            cerr << ", " << max_windows << " at a time";
+        }
+        cerr << endl;
+    }
+
+    unique_ptr<input_reader> reader(unsigned node) override
+    {
+        return make_unique<window_reader>(*this, node);
+    }
+
+    string finish() override
+    {
+        ranges_.report();
+        return {};
+    }
+
+private:
+    struct window_reader : input_reader {
+        window_reader(window_backend& backend, unsigned node)
+            : backend_ { backend }
+            , ranges_ { backend.ranges_, node }
+        {
+        }
+
+        ~window_reader() override
+        {
+            unmap();
+        }
+
+        bool next(string_view& lines, size_t& slot) override
+        {
+            unmap();
+            const auto r = ranges_.next();
+            if (!r) {
+                return false;
+            }
+            backend_.acquire();
+            try {
+                window_.emplace(*r->file->fd, r->file->size, r->begin, r->end, backend_.hints_, backend_.release_);
+            } catch (...) {
+                backend_.release();
+                throw;
+            }
+            lines = *window_;
+            slot = r->file->slot;
+            file_ = r->file;
+            return true;
+        }
+
+        string where(const char* p) const override
+        {
+            return input_position(file_->fd->path(), window_->offset_of(p));
+        }
+
+    private:
+        void unmap()
+        {
+            if (window_) {
+                window_.reset();
+                backend_.release();
+            }
+        }
+
+        window_backend& backend_;
+        range_queue::taker ranges_;
+        const ranged_file* file_ {};
+        optional<mmap_window> window_;
+    };
+
+    // A window to map, waiting for one to be unmapped if need be.
+    void acquire()
+    {
+        if (max_windows_) {
+            unique_lock lock { mutex_ };
+            unmapped_.wait(lock, [&] { return mapped_ < max_windows_; });
+            ++mapped_;
+        }
+    }
+
+    void release()
+    {
+        if (max_windows_) {
+            {
+                lock_guard lock { mutex_ };
+                --mapped_;
+            }
+            unmapped_.notify_one();
+        }
+    }
+
+    range_queue ranges_;
+    map_hints hints_;
+    bool release_;
+    const size_t max_windows_;
+    mutex mutex_;
+    condition_variable unmapped_;
+    size_t mapped_ {};
+};
+
+// Each parser reads its ranges with pread(2) into a buffer of its own.
+// Nothing is mapped, so there are no page faults on a shared mapping.
+struct pread_backend : input_backend {
+    pread_backend(const vector<ranged_file>& files, const chunking& how)
+        : ranges_ { files, how }
+    {
+        cerr << "pread_backend: " << files.size() << " files in ranges of up to " << how.max_size << endl;
+    }
+
+    unique_ptr<input_reader> reader(unsigned node) override
+    {
+        return make_unique<pread_reader>(*this, node);
+    }
+
+    string finish() override
+    {
+        ranges_.report();
+        return {};
+    }
+
+private:
+    struct pread_reader : input_reader {
+        pread_reader(pread_backend& backend, unsigned node)
+            : backend_ { backend }
+            , ranges_ { backend.ranges_, node }
+        {
+        }
+
+        bool next(string_view& lines, size_t& slot) override
+        {
+            while (const auto r = ranges_.next()) {
+                const auto offset = r->begin ? r->begin - 1 : 0;
+                const auto size = min(r->file->size, r->end + max_line_size) - offset;
+                if (buffer_.size() < size) {
+                    buffer_.resize(size);
+                }
+                const auto n = r->file->fd->read_at(buffer_.data(), size, offset);
+                lines = lines_in({ buffer_.data(), n }, offset, r->begin, r->end, r->file->size, r->file->fd->path());
+                slot = r->file->slot;
+                file_ = r->file;
+                offset_ = offset;
+                if (!lines.empty()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        string where(const char* p) const override
+        {
+            return input_position(file_->fd->path(), offset_ + (p - buffer_.data()));
+        }
+
+    private:
+        pread_backend& backend_;
+        range_queue::taker ranges_;
+        vector<char> buffer_;
+        const ranged_file* file_ {};
+        size_t offset_ {}; // Of the buffer in the file.
+    };
+
+    range_queue ranges_;
+};
+
+// Buffers filled by a reader thread: streams, io_uring and decompression.
+struct buffered_backend : input_backend {
+    buffered_backend(unique_ptr<buffered_input> input, size_t slot)
+        : input_ { move(input) }
+        , slot_ { slot }
+    {
+    }
+
+    unique_ptr<input_reader> reader(unsigned) override
+    {
+        return make_unique<buffer_reader>(*this);
+    }
+
+    string finish() override
+    {
+        input_->finish();
+        return {};
+    }
+
+private:
+    struct buffer_reader : input_reader {
+        explicit buffer_reader(buffered_backend& backend)
+            : backend_ { backend }
+        {
+        }
+
+        // Still holding a buffer means the parser failed, the reader thread
+        // mustn't wait for it.
+        ~buffer_reader() override
+        {
+            if (buffer_) {
+                backend_.input_->abort();
+            }
+        }
+
+        bool next(string_view& lines, size_t& slot) override
+        {
+            if (buffer_) {
+                backend_.input_->release(buffer_);
+            }
+            buffer_ = backend_.input_->next();
+            if (!buffer_) {
+                return false;
+            }
+            lines = buffer_->lines;
+            slot = backend_.slot_;
+            return true;
+        }
+
+        string where(const char* p) const override
+        {
+            return input_position(backend_.input_->path(), buffer_->offset + (p - buffer_->lines.data()));
+        }
+
+    private:
+        buffered_backend& backend_;
+        stream_buffer* buffer_ {};
+    };
+
+    unique_ptr<buffered_input> input_;
+    size_t slot_;
+};
+
+// Compressed frames decompressed by the parsers, see framed_input.
+struct framed_backend : input_backend {
+    framed_backend(unique_ptr<framed_input> input, size_t slot)
+        : input_ { move(input) }
+        , slot_ { slot }
+    {
+    }
+
+    unique_ptr<input_reader> reader(unsigned) override
+    {
+        return make_unique<frame_reader>(*this);
+    }
+
+    string finish() override
+    {
+        return input_->stitch();
+    }
+
+    string where() const override
+    {
+        return input_->path() + ": lines across frames";
+    }
+
+private:
+    struct frame_reader : input_reader {
+        explicit frame_reader(framed_backend& backend)
+            : backend_ { backend }
+            , decoder_ { backend.input_->decoder() }
+        {
+        }
+
+        bool next(string_view& lines, size_t& slot) override
+        {
+            const auto text = backend_.input_->next(*decoder_, buffer_, frame_);
+            if (!text) {
+                return false;
+            }
+            lines = *text;
+            slot = backend_.slot_;
+            return true;
+        }
+
+        // Offsets of the frames once decompressed are not known, only those
+        // in each frame.
+        string where(const char* p) const override
+        {
+            return input_position(backend_.input_->path() + ": frame " + to_string(frame_), p - buffer_.data());
+        }
+
+    private:
+        framed_backend& backend_;
+        unique_ptr<stream_decoder> decoder_;
+        vector<char> buffer_;
+        size_t frame_ {};
+    };
+
+    unique_ptr<framed_input> input_;
+    size_t slot_;
+};
+
+//----------------------------------------------------------------------------
+// Prefetching of mapped input ahead of the parsers, so that they don't stall
+// on major faults when the page cache is cold.
+
+// Position of a parser in its chunk, published for the prefetchers. Both
+// ends go under a seqlock, so that a prefetcher never pairs the position in
+// one mapping with the end of a chunk in another.
+struct alignas(64) parse_cursor {
+    void publish(const char* position, const char* end)
+    {
+        const auto g = generation_.load(memory_order_relaxed);
+        generation_.store(g + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        position_.store(position, memory_order_relaxed);
+        end_.store(end, memory_order_relaxed);
+        generation_.store(g + 2, memory_order_release);
+    }
+
+    // False when the parser was publishing at the same time.
+    bool read(const char*& position, const char*& end) const
+    {
+        const auto g = generation_.load(memory_order_acquire);
+        if (g & 1) {
+            return false;
+        }
+        position = position_.load(memory_order_relaxed);
+        end = end_.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        return generation_.load(memory_order_relaxed) == g;
+    }
+
+private:
+    atomic<unsigned> generation_ { 0 };
+    atomic<const char*> position_ { nullptr };
+    atomic<const char*> end_ { nullptr };
+};
+
+// Bytes between parse_cursor updates.
+constexpr size_t parse_slice_size = 256 << 10;
+
+struct prefetcher {
+    // Fixed distance, or adapted to the rate pages come in with 0.
+    prefetcher(vector<parse_cursor>& cursors, unsigned n_threads, size_t distance)
+        : cursors_ { cursors }
+        , adaptive_ { distance == 0 }
+        , distance_ { distance ? distance : min_distance }
+    {
+        for (unsigned i = 0; i < n_threads; ++i) {
+            threads_.emplace_back([this, i, n_threads] { prefetch(i, n_threads); });
+        }
+    }
+
+    ~prefetcher()
+    {
+        done_ = true;
+        for (auto& t : threads_) {
+            t.join();
+        }
+        cerr << "prefetcher: distance " << distance_ << ", touched " << touched_ << endl;
+    }
+
+    prefetcher(const prefetcher&) = delete;
+    prefetcher& operator=(const prefetcher&) = delete;
+
+private:
+    static constexpr size_t min_distance = 1 << 20;
+    static constexpr size_t max_distance = 64 << 20;
+    static constexpr double horizon = 0.05; // Seconds of input to keep ahead.
+
+    // Thread index looks after every n-th parser.
+    void prefetch(unsigned index, unsigned n)
+    {
+        vector<const char*> ahead(cursors_.size());
+        size_t batch = 0;
+        auto batch_start = steady_clock::now();
+        unsigned char sum = 0;
+
+        while (!done_) {
+            size_t touched = 0;
+            for (size_t w = index; w < cursors_.size(); w += n) {
+                const char* position;
+                const char* end;
+                if (!cursors_[w].read(position, end) || !position || position >= end) {
+                    continue;
+                }
+                if (ahead[w] < position || ahead[w] > end) {
+                    ahead[w] = position;
+                }
+                const auto stop = position + min<size_t>(distance_, end - position);
+                const auto page = reinterpret_cast<uintptr_t>(ahead[w]) & ~(page_size - 1);
+                for (auto p = reinterpret_cast<const char*>(page) + page_size; p < stop; p += page_size) {
+                    sum += *static_cast<const volatile char*>(p);
+                    touched += page_size;
+                }
+                ahead[w] = max(ahead[w], stop);
+            }
+            if (touched == 0) {
+                sleep_for(microseconds(100));
+                continue;
+            }
+            touched_ += touched;
+            batch += touched;
+            if (adaptive_ && batch >= min_distance) {
+                const duration<double> elapsed = steady_clock::now() - batch_start;
+                const auto rate = batch / elapsed.count();
+                distance_ = clamp(static_cast<size_t>(rate * horizon), min_distance, max_distance);
+                batch = 0;
+                batch_start = steady_clock::now();
+            }
+        }
+        sink_ += sum;
+    }
+
+    vector<parse_cursor>& cursors_;
+    const bool adaptive_;
+    atomic<size_t> distance_;
+    atomic<size_t> touched_ { 0 };
+    atomic<bool> done_ { false };
+    atomic<unsigned char> sink_ { 0 }; // Keeps the reads.
+    vector<thread> threads_;
+};
+
+//----------------------------------------------------------------------------
+// Parse and process lines from text.
+
+// Results in the order of names, sorted once at the end, see ordered().
+template <typename Stats>
+using ordered_statistics = vector<pair<string_view, const Stats*>>;
+template <typename Stats>
+using unordered_statistics = unordered_map<string_view, Stats>;
+
+// Storage for station names, which outlive the input they were parsed from.
+struct key_arena {
+    string_view intern(string_view s)
+    {
+        if (s.size() > capacity_ - used_) {
+            capacity_ = max(block_size, s.size());
+            blocks_.push_back(make_unique<char[]>(capacity_));
+            used_ = 0;
+        }
+        char* const p = blocks_.back().get() + used_;
+        memcpy(p, s.data(), s.size());
+        used_ += s.size();
+        return { p, s.size() };
+    }
+
+    // Takes over the storage of other, so that its keys stay valid.
+    void absorb(key_arena&& other)
+    {
+        blocks_.insert(blocks_.begin(), make_move_iterator(other.blocks_.begin()), make_move_iterator(other.blocks_.end()));
+        other.blocks_.clear();
+        other.capacity_ = other.used_ = 0;
+    }
+
+private:
+    static constexpr size_t block_size = 64 * 1024;
+
+    vector<unique_ptr<char[]>> blocks_;
+    size_t capacity_ {};
+    size_t used_ {};
+};
+
+template <typename Stats>
+struct station_table {
+    Stats& operator[](string_view name)
+    {
+        if (const auto it = stats.find(name); it != stats.end()) {
+            return it->second;
+        }
+        return stats[keys.intern(name)];
+    }
+
+    // Adds the results of other, without copying its keys.
+    void merge(station_table&& other)
+    {
+        for (const auto& item : other.stats) {
+            if (const auto [it, inserted] = stats.insert(item); !inserted) {
+                it->second.update(item.second);
+            }
+        }
+        keys.absorb(move(other.keys));
+        other.stats.clear();
+        checksum += other.checksum;
+    }
+
+    key_arena keys;
+    unordered_statistics<Stats> stats { 1000 };
+    uint64_t checksum {}; // Of the lines, when asked for.
+};
+
+template <bool checksum, typename Stats>
+void aggregate(string_view input, station_table<Stats>& result)
+{
+    while (!input.empty()) {
+        const auto [line, other_lines] = first_line(input);
+        const auto [name, value] = record(line);
+        result[name].update(value);
+        if constexpr (checksum) {
+            result.checksum += line_checksum(line);
+        }
+        input = other_lines;
+    }
+}
+
+template <typename Stats>
+void aggregate(string_view input, station_table<Stats>& result, bool checksum)
+{
+    if (checksum) {
+        aggregate<true>(input, result);
+    } else {
+        aggregate<false>(input, result);
+    }
+}
+
+// The first line of input which doesn't parse.
+string_view bad_line(string_view input)
+{
+    while (!input.empty()) {
+        const auto [line, other_lines] = first_line(input);
+        try {
+            record(line);
+        } catch (const invalid_argument&) {
+            return line;
+        }
+        input = other_lines;
+    }
+    return {};
+}
+
+// As aggregate(), with a line which doesn't parse reported where(p) of its
+// start says. Lines are found again only then, so that parsing is as fast.
+template <typename Stats, typename Where>
+void aggregate(string_view input, station_table<Stats>& result, bool checksum, const Where& where)
+{
+    try {
+        aggregate(input, result, checksum);
+    } catch (const invalid_argument&) {
+        const auto line = bad_line(input);
+        throw runtime_error(where(line.data()) + ": invalid line \"" + string(line.substr(0, 80)) + "\"");
+    }
+}
+
+// Tables by slot, of the slots of the input which it has lines for. Slots
+// are in increasing order, and their tables made as they are met.
+template <typename Stats>
+vector<pair<size_t, station_table<Stats>>> aggregate_input(input_backend& input, const vector<size_t>& slots, unsigned node, parse_cursor* cursor, bool checksum)
+{
+    vector<optional<station_table<Stats>>> tables(slots.size());
+    const auto reader = input.reader(node);
+    const auto where = [&](const char* p) { return reader->where(p); };
+    size_t n = 0;
+    string_view text;
+    size_t slot;
+    for (; reader->next(text, slot); ++n) {
+        auto& entry = tables[lower_bound(slots.begin(), slots.end(), slot) - slots.begin()];
+        if (!entry) {
+            entry.emplace();
+        }
+        auto& table = *entry;
+        if (!cursor) {
+            aggregate(text, table, checksum, where);
+            continue;
+        }
+        const auto end_of_text = text.data() + text.size();
+        while (!text.empty()) {
+            cursor->publish(text.data(), end_of_text);
+            auto end = text.size() > parse_slice_size ? text.find_first_of('\n', parse_slice_size) : string_view::npos;
+            end = end == string_view::npos ? text.size() : end + 1;
+            aggregate(text.substr(0, end), table, checksum, where);
+            text.remove_prefix(end);
+        }
+    }
+    if (cursor) {
+        cursor->publish(nullptr, nullptr);
+    }
+    cerr << "aggregate: " << n << " pieces" << endl;
+
+    vector<pair<size_t, station_table<Stats>>> result;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (tables[i] && !tables[i]->stats.empty()) {
+            result.emplace_back(slots[i], move(*tables[i]));
+        }
+    }
+    return result;
+}
+
+// Number of bytes with an optional K, M or G suffix.
+size_t parse_size(string_view s)
+{
+    size_t unit = 1;
+    if (!s.empty()) {
+        switch (s.back()) {
+        case 'K':
+        case 'k':
+            unit = 1 << 10;
+            break;
+        case 'M':
+        case 'm':
+            unit = 1 << 20;
+            break;
+        case 'G':
+        case 'g':
+            unit = 1 << 30;
+            break;
+        }
+    }
+    if (unit != 1) {
+        s.remove_suffix(1);
+    }
+    if (s.empty()) {
+        throw invalid_argument("empty size");
+    }
+    size_t n = 0;
+    for (const auto c : s) {
+        n = n * 10 + digit(c);
+    }
+    return n * unit;
+}
+
+enum class io_mode { mmap, private_mmap, pread, stream, uring };
+
+enum class pin_mode {
+    none,
+    compact, // Hyperthreads of a core, then the cores of a package.
+    scatter, // A core of each package, then the next cores, hyperthreads last.
+    cores, // One parser on each core.
+    all, // One parser on each hyperthread.
+};
+
+enum class exit_mode {
+    normal,
+    fast, // Skip the teardown.
+    background, // Leave the teardown to a child, see detach().
+};
+
+// Where a parser runs.
+struct worker_place {
+    vector<unsigned> cpus; // Bound to, any with none.
+    unsigned node {};
+};
+
+struct options {
+    vector<column> columns;
+    output_format format { output_format::tsv };
+    string partial; // Where to write the partial result, with non-empty.
+    bool merge {}; // Inputs are partial results.
+    string cache; // Directory of cached results, with non-empty.
+    bool cache_verify {}; // Checksum files before using their cached results.
+    map_hints hints;
+    io_mode io { io_mode::mmap };
+    bool per_file {}; // Results of each file before the total.
+    unsigned prefetch_threads {};
+    size_t prefetch_distance {}; // Adaptive with 0.
+    size_t max_rss {}; // Map files in windows and size buffers to stay within, with non-zero.
+    size_t chunk_size { 4 << 20 }; // Bytes taken by a parser at a time, at most.
+    bool adaptive { true }; // Smaller chunks for slower parsers and towards the end.
+    unsigned workers {}; // Parsers, as many as the CPUs available with 0.
+    unsigned spin {}; // Microseconds idle parsers poll for, see thread_pool.
+    pin_mode pin { pin_mode::none };
+    bool numa {}; // Ranges and merges by NUMA node.
+    vector<worker_place> places; // Of each parser.
+    vector<vector<unsigned>> node_cpus; // With numa, by node.
+    size_t memory_limit {}; // Of the cgroups, with non-zero.
+    exit_mode exit { exit_mode::normal };
+    int exit_fd { -1 }; // Where the background child reports, see detach().
+};
+
+//----------------------------------------------------------------------------
+// Resources granted to the process. In a container, these are fewer than
+// the host has: the CPU affinity, which cpusets restrict as well, and the
+// CPU quota and memory limit of the cgroups.
+
+// The first line of a file, empty if it can't be read.
+string read_line(const string& path)
+{
+    ifstream in(path);
+    string line;
+    getline(in, line);
+    return line;
+}
+
+bool contains(string_view list, string_view item)
+{
+    for (size_t end; !list.empty(); list.remove_prefix(end == string_view::npos ? list.size() : end + 1)) {
+        end = list.find(',');
+        if (list.substr(0, end) == item) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Directories of the cgroups of the process with a controller, from its own
+// up to the root of the hierarchy. An empty controller for cgroup v2.
+vector<string> cgroup_dirs(string_view controller)
+{
+    vector<string> dirs;
+    ifstream in("/proc/self/cgroup");
+    for (string line; getline(in, line);) {
+        // hierarchy-ID:controller-list:cgroup-path
+        const auto first = line.find(':');
+        const auto second = line.find(':', first + 1);
+        if (first == string::npos || second == string::npos) {
+            continue;
+        }
+        const auto controllers = string_view(line).substr(first + 1, second - first - 1);
+        string root;
+        if (controller.empty() && controllers.empty()) {
+            // The unified hierarchy, on its own or next to v1 ones.
+            root = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified";
+        } else if (!controller.empty() && contains(controllers, controller)) {
+            root = "/sys/fs/cgroup/" + string(controllers);
+        } else {
+            continue;
+        }
+        auto path = line.substr(second + 1);
+        if (path == "/") {
+            path.clear();
+        }
+        for (;;) {
+            dirs.push_back(root + path);
+            if (path.empty()) {
+                break;
+            }
+            path.erase(path.rfind('/'));
+        }
+    }
+    return dirs;
+}
+
+// Logical CPUs the process may run on.
+vector<unsigned> allowed_cpus()
+{
+    vector<unsigned> ids;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        // More CPUs than a cpu_set_t holds.
+        for (unsigned i = 0; i < thread::hardware_concurrency(); ++i) {
+            ids.push_back(i);
+        }
+        return ids;
+    }
+    for (unsigned i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set)) {
+            ids.push_back(i);
+        }
+    }
+    return ids;
+}
+
+// CPUs the cgroup quotas allow, rounded up, or 0 without a quota.
+unsigned cgroup_cpus()
+{
+    double cpus = 0;
+    const auto limit = [&](const string& quota, const string& period) {
+        const auto n = strtod(quota.c_str(), nullptr) / strtod(period.c_str(), nullptr);
+        if (n > 0 && (!cpus || n < cpus)) {
+            cpus = n;
+        }
+    };
+    for (const auto& dir : cgroup_dirs("")) {
+        // "max 100000" without a quota.
+        const auto max = read_line(dir + "/cpu.max");
+        const auto space = max.find(' ');
+        if (space != string::npos && max.compare(0, space, "max") != 0) {
+            limit(max.substr(0, space), max.substr(space + 1));
+        }
+    }
+    for (const auto& dir : cgroup_dirs("cpu")) {
+        // -1 without a quota.
+        limit(read_line(dir + "/cpu.cfs_quota_us"), read_line(dir + "/cpu.cfs_period_us"));
+    }
+    return ceil(cpus);
+}
+
+// Bytes the cgroups allow, or 0 without a limit.
+size_t cgroup_memory()
+{
+    size_t memory = 0;
+    const auto limit = [&](const string& value) {
+        // "max" in v2, close to the largest number in v1.
+        const size_t bytes = strtoull(value.c_str(), nullptr, 10);
+        if (bytes && bytes < size_t(1) << 60 && (!memory || bytes < memory)) {
+            memory = bytes;
+        }
+    };
+    for (const auto& dir : cgroup_dirs("")) {
+        limit(read_line(dir + "/memory.max"));
+    }
+    for (const auto& dir : cgroup_dirs("memory")) {
+        limit(read_line(dir + "/memory.limit_in_bytes"));
+    }
+    return memory;
+}
+
+//----------------------------------------------------------------------------
+// Placement of the parsers on the CPUs, along the topology in sysfs.
+
+struct logical_cpu {
+    unsigned id;
+    unsigned node; // Among the NUMA nodes with CPUs we may run on, from 0.
+    unsigned package;
+    unsigned core; // Among the cores of its package, from 0.
+    unsigned thread; // Among the hyperthreads of its core, from 0.
+};
+
+// A list such as 0-3,8-11 in sysfs.
+vector<unsigned> parse_list(string_view list)
+{
+    vector<unsigned> ids;
+    while (!list.empty()) {
+        auto end = list.find(',');
+        const auto range = list.substr(0, end);
+        const auto dash = range.find('-');
+        const auto first = unsigned(parse_size(range.substr(0, dash)));
+        const auto last = dash == string_view::npos ? first : unsigned(parse_size(range.substr(dash + 1)));
+        for (auto id = first; id <= last; ++id) {
+            ids.push_back(id);
+        }
+        list.remove_prefix(end == string_view::npos ? list.size() : end + 1);
+    }
+    return ids;
+}
+
+vector<logical_cpu> topology(const vector<unsigned>& ids)
+{
+    const auto number = [](const string& path, unsigned otherwise) {
+        const auto value = read_line(path);
+        return value.empty() ? otherwise : unsigned(strtoul(value.c_str(), nullptr, 10));
+    };
+
+    vector<logical_cpu> cpus;
+    map<pair<unsigned, unsigned>, unsigned> threads;
+    for (const auto id : ids) {
+        const auto dir = "/sys/devices/system/cpu/cpu" + to_string(id) + "/topology/";
+        const auto package = number(dir + "physical_package_id", 0);
+        const auto core = number(dir + "core_id", id);
+        cpus.push_back({ id, 0, package, core, threads[{ package, core }]++ });
+    }
+
+    // Nodes without any of the CPUs get no parsers, and aren't counted.
+    map<unsigned, unsigned> node_of;
+    for (const auto node : parse_list(read_line("/sys/devices/system/node/online"))) {
+        for (const auto id : parse_list(read_line("/sys/devices/system/node/node" + to_string(node) + "/cpulist"))) {
+            node_of.emplace(id, node);
+        }
+    }
+    map<unsigned, unsigned> nodes;
+    for (auto& cpu : cpus) {
+        if (const auto it = node_of.find(cpu.id); it != node_of.end()) {
+            cpu.node = nodes.emplace(it->second, nodes.size()).first->second;
+        }
+    }
+
+    // Core IDs are sparse, and unique within a package only.
+    map<unsigned, unsigned> cores;
+    for (auto& [core, index] : threads) {
+        index = cores[core.first]++;
+    }
+    for (auto& cpu : cpus) {
+        cpu.core = threads.at({ cpu.package, cpu.core });
+    }
+    return cpus;
+}
+
+// CPUs for the parsers in turn, starting over when there are more parsers.
+vector<unsigned> placement(vector<logical_cpu> cpus, pin_mode pin)
+{
+    const auto order = [&](auto key) {
+        stable_sort(cpus.begin(), cpus.end(), [&](const logical_cpu& a, const logical_cpu& b) { return key(a) < key(b); });
+    };
+    switch (pin) {
+    case pin_mode::none:
+        return {};
+    case pin_mode::compact:
+    case pin_mode::all:
+        order([](const logical_cpu& c) { return make_tuple(c.package, c.core, c.thread); });
+        break;
+    case pin_mode::cores:
+        cpus.erase(remove_if(cpus.begin(), cpus.end(), [](const logical_cpu& c) { return c.thread != 0; }), cpus.end());
+        [[fallthrough]];
+    case pin_mode::scatter:
+        order([](const logical_cpu& c) { return make_tuple(c.thread, c.core, c.package); });
+        break;
+    }
+    vector<unsigned> ids;
+    for (const auto& cpu : cpus) {
+        ids.push_back(cpu.id);
+    }
+    return ids;
+}
+
+// Binds the calling thread to CPUs, unless there are none.
+void pin(const vector<unsigned>& cpus)
+{
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (const auto error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        cerr << "pin: " << strerror(error) << endl;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Parser threads, started once and placed once, which runs reuse. They take
+// jobs from one queue, which coroutines of the pipeline resume on as well.
+
+struct thread_pool {
+    // With spin, idle workers poll for that long before they sleep, so that
+    // jobs which follow each other closely don't wait for them to wake up.
+    thread_pool(const vector<worker_place>& places, microseconds spin)
+        : spin_ { spin }
+    {
+        for (unsigned i = 0; i < places.size(); ++i) {
+            threads_.emplace_back([this, i, cpus = places[i].cpus] {
+                pin(cpus);
+                work(i);
+            });
+        }
+    }
+
+    // Runs the jobs left first.
+    ~thread_pool()
+    {
+        {
+            lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    unsigned size() const
+    {
+        return threads_.size();
+    }
+
+    // Queues a job, which must not throw. It gets the index of the worker
+    // which runs it.
+    void post(function<void(unsigned)> job)
+    {
+        {
+            lock_guard lock(mutex_);
+            jobs_.push_back(move(job));
+            queued_.store(jobs_.size());
+        }
+        wake_.notify_one();
+    }
+
+    // Runs f(i) for each i below size() and waits for all of them. Throws
+    // the first error of any. Not for the workers themselves, which could
+    // all end up waiting.
+    void each(const function<void(unsigned)>& f)
+    {
+        mutex m;
+        condition_variable all_done;
+        size_t remaining = size();
+        exception_ptr error;
+        for (unsigned i = 0; i < size(); ++i) {
+            post([&, i](unsigned) {
+                try {
+                    f(i);
+                } catch (...) {
+                    lock_guard lock(m);
+                    if (!error) {
+                        error = current_exception();
+                    }
+                }
+                lock_guard lock(m);
+                if (--remaining == 0) {
+                    all_done.notify_one();
+                }
+            });
+        }
+        unique_lock lock(m);
+        all_done.wait(lock, [&] { return remaining == 0; });
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+    // Awaited to go on on a worker.
+    auto schedule()
+    {
+        struct awaiter {
+            thread_pool& pool;
+
+            bool await_ready() const
+            {
+                return false;
+            }
+
+            void await_suspend(coroutine_handle<> h)
+            {
+                pool.post([h](unsigned) { h.resume(); });
+            }
+
+            void await_resume() const
+            {
+            }
+        };
+        return awaiter { *this };
+    }
+
+private:
+    void work(unsigned i)
+    {
+        for (;;) {
+            for (const auto until = steady_clock::now() + spin_; !queued_.load() && steady_clock::now() < until;) {
+                yield();
+            }
+            unique_lock lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                return;
+            }
+            auto job = move(jobs_.front());
+            jobs_.pop_front();
+            queued_.store(jobs_.size());
+            lock.unlock();
+
+            job(i);
+        }
+    }
+
+    microseconds spin_;
+    vector<thread> threads_;
+    mutex mutex_;
+    condition_variable wake_;
+    deque<function<void(unsigned)>> jobs_;
+    atomic<size_t> queued_ { 0 }; // Polled without the lock.
+    bool stop_ {};
+};
+
+// Coroutine which starts right away and goes away once it returns. It has
+// to catch its errors itself.
+struct detached_task {
+    struct promise_type {
+        detached_task get_return_object()
+        {
+            return {};
+        }
+
+        suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            terminate();
+        }
+    };
+};
+
+// Awaited to run f(worker) as n jobs on the pool. The last one to finish
+// goes on with the coroutine, and the first error is thrown there.
+template <typename F>
+auto fan_out(thread_pool& pool, unsigned n, F f)
+{
+    struct awaiter {
+        thread_pool& pool;
+        unsigned n;
+        F f;
+        atomic<unsigned> remaining;
+        mutex error_mutex;
+        exception_ptr error;
+
+        bool await_ready() const
+        {
+            return n == 0;
+        }
+
+        void await_suspend(coroutine_handle<> h)
+        {
+            remaining = n;
+            // Once the last job is posted, this may be gone already.
+            auto& p = pool;
+            for (unsigned k = 0, count = n; k < count; ++k) {
+                p.post([this, h](unsigned worker) {
+                    try {
+                        f(worker);
+                    } catch (...) {
+                        lock_guard lock(error_mutex);
+                        if (!error) {
+                            error = current_exception();
+                        }
+                    }
+                    if (--remaining == 0) {
+                        h.resume();
+                    }
+                });
+            }
+        }
+
+        void await_resume()
+        {
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+    };
+    return awaiter { pool, n, move(f), {}, {}, {} };
+}
+
+// Awaited to take one of a number of places, which release() gives back,
+// resuming a coroutine waiting for one on the pool.
+struct async_semaphore {
+    async_semaphore(thread_pool& pool, unsigned count)
+        : pool_ { pool }
+        , free_ { count }
+    {
+    }
+
+    auto acquire()
+    {
+        struct awaiter {
+            async_semaphore& s;
+
+            bool await_ready() const
+            {
+                return false;
+            }
+
+            bool await_suspend(coroutine_handle<> h)
+            {
+                lock_guard lock(s.mutex_);
+                if (s.free_) {
+                    --s.free_;
+                    return false;
+                }
+                s.waiting_.push_back(h);
+                return true;
+            }
+
+            void await_resume() const
+            {
+            }
+        };
+        return awaiter { *this };
+    }
+
+    void release()
+    {
+        coroutine_handle<> next;
+        {
+            lock_guard lock(mutex_);
+            if (waiting_.empty()) {
+                ++free_;
+                return;
+            }
+            next = waiting_.front();
+            waiting_.pop_front();
+        }
+        pool_.post([next](unsigned) { next.resume(); });
+    }
+
+private:
+    thread_pool& pool_;
+    mutex mutex_;
+    unsigned free_;
+    deque<coroutine_handle<>> waiting_;
+};
+
+//----------------------------------------------------------------------------
+// Arrow IPC output. The metadata are flatbuffers, built by hand after the
+// schemas of the format (Schema.fbs, Message.fbs and File.fbs), and the body
+// is the columns as they are laid out in memory.
+
+// Builds a flatbuffer back to front, as the flatbuffers library does:
+// children go in before their parents, which refer to them forward.
+struct flatbuffer {
+    // An object, by its distance from the end of the buffer, which stays the
+    // same as the buffer grows at the front.
+    using ref = uint32_t;
+
+    // Of a table.
+    struct field {
+        uint16_t id;
+        unsigned size; // Of a scalar, 0 for a child.
+        uint64_t value; // The scalar, or the child.
+    };
+
+    template <typename T>
+    static field scalar(uint16_t id, T value)
+    {
+        field f { id, sizeof(T), 0 };
+        memcpy(&f.value, &value, sizeof(T));
+        return f;
+    }
+
+    static field child(uint16_t id, ref r)
+    {
+        return { id, 0, r };
+    }
+
+    ref table(vector<field> fields)
+    {
+        // Largest first, so that each is aligned after the one before.
+        const auto size = [](const field& f) { return f.size ? f.size : sizeof(ref); };
+        stable_sort(fields.begin(), fields.end(), [&](const field& a, const field& b) { return size(a) > size(b); });
+        string bytes(sizeof(int32_t), '\0'); // Offset to the vtable.
+        vector<uint16_t> vtable(2);
+        size_t align = sizeof(int32_t);
+        for (const auto& f : fields) {
+            bytes.resize((bytes.size() + size(f) - 1) / size(f) * size(f));
+            vtable.resize(max<size_t>(vtable.size(), f.id + 3));
+            vtable[f.id + 2] = bytes.size();
+            bytes.append(reinterpret_cast<const char*>(&f.value), size(f));
+            align = max(align, size(f));
+        }
+        pad(bytes.size(), align);
+        const ref at = data_.size() + bytes.size();
+        for (const auto& f : fields) {
+            if (!f.size) {
+                const uint32_t offset = at - vtable[f.id + 2] - f.value;
+                memcpy(&bytes[vtable[f.id + 2]], &offset, sizeof(offset));
+            }
+        }
+        data_.insert(0, bytes);
+        vtable[0] = vtable.size() * sizeof(uint16_t);
+        vtable[1] = bytes.size();
+        data_.insert(0, reinterpret_cast<const char*>(vtable.data()), vtable[0]);
+        const int32_t to_vtable = data_.size() - at;
+        memcpy(&data_[data_.size() - at], &to_vtable, sizeof(to_vtable));
+        return at;
+    }
+
+    ref tables(const vector<ref>& items)
+    {
+        pad(items.size() * sizeof(ref), sizeof(ref));
+        for (auto it = items.rbegin(); it != items.rend(); ++it) {
+            prepend(static_cast<uint32_t>(data_.size() + sizeof(ref) - *it));
+        }
+        return prepend(static_cast<uint32_t>(items.size()));
+    }
+
+    template <typename T>
+    ref structs(const vector<T>& items)
+    {
+        const auto size = items.size() * sizeof(T);
+        pad(size, max(alignof(T), sizeof(uint32_t)));
+        data_.insert(0, reinterpret_cast<const char*>(items.data()), size);
+        return prepend(static_cast<uint32_t>(items.size()));
+    }
+
+    ref text(string_view s)
+    {
+        pad(s.size() + 1, sizeof(uint32_t));
+        data_.insert(0, 1, '\0');
+        data_.insert(0, s);
+        return prepend(static_cast<uint32_t>(s.size()));
+    }
+
+    // The buffer, starting with the offset of the root table, in a multiple
+    // of 8 bytes, which keeps what is aligned from the end aligned.
+    string finish(ref root)
+    {
+        pad(sizeof(ref), 8);
+        prepend(static_cast<uint32_t>(data_.size() + sizeof(ref) - root));
+        return move(data_);
+    }
+
+private:
+    template <typename T>
+    ref prepend(T value)
+    {
+        data_.insert(0, reinterpret_cast<const char*>(&value), sizeof(value));
+        return data_.size();
+    }
+
+    // So that size bytes put in front next start aligned.
+    void pad(size_t size, size_t align)
+    {
+        data_.insert(0, (align - (data_.size() + size) % align) % align, '\0');
+    }
+
+    string data_;
+};
+
+// Values from the Arrow schemas.
+constexpr int16_t arrow_v5 = 4; // MetadataVersion
+constexpr uint8_t arrow_int = 2; // Type
+constexpr uint8_t arrow_floating_point = 3;
+constexpr uint8_t arrow_utf8 = 5;
+constexpr int16_t arrow_double = 2; // Precision
+constexpr uint8_t arrow_schema = 1; // MessageHeader
+constexpr uint8_t arrow_record_batch = 3;
+
+struct arrow_block {
+    int64_t offset;
+    int32_t metadata_size;
+    int32_t padding;
+    int64_t body_size;
+};
+
+struct arrow_node {
+    int64_t length;
+    int64_t null_count;
+};
+
+struct arrow_buffer {
+    int64_t offset;
+    int64_t length;
+};
+
+// Buffers in a body are padded to a multiple of 8 bytes.
+constexpr size_t arrow_padded(size_t size)
+{
+    return (size + 7) & ~size_t { 7 };
+}
+
+// The station as a utf8 column, then the columns as doubles, or int64 for
+// the count, none of them nullable.
+flatbuffer::ref arrow_schema_table(flatbuffer& fb, const vector<column>& columns)
+{
+    vector<flatbuffer::ref> fields;
+    const auto add = [&](string_view name, uint8_t type_type, flatbuffer::ref type) {
+        const auto n = fb.text(name);
+        const auto children = fb.tables({});
+        fields.push_back(fb.table({ flatbuffer::child(0, n), flatbuffer::scalar(2, type_type), flatbuffer::child(3, type), flatbuffer::child(5, children) }));
+    };
+    add("station", arrow_utf8, fb.table({}));
+    for (const auto& c : columns) {
+        if (c.what == field::count) {
+            add(column_name(c), arrow_int, fb.table({ flatbuffer::scalar<int32_t>(0, 64), flatbuffer::scalar(1, true) }));
+        } else {
+            add(column_name(c), arrow_floating_point, fb.table({ flatbuffer::scalar(0, arrow_double) }));
+        }
+    }
+    return fb.table({ flatbuffer::child(1, fb.tables(fields)) });
+}
+
+// The results as a single record batch. The file format is the stream
+// format between magic numbers, and a footer which locates its messages,
+// for readers to map the file and use the columns where they are.
+template <typename Stats>
+void print_arrow(output_buffer& out, const ordered_statistics<Stats>& result, const vector<column>& columns, bool file)
+{
+    const auto n = static_cast<int64_t>(result.size());
+    vector<int32_t> offsets { 0 };
+    offsets.reserve(result.size() + 1);
+    size_t names_size = 0;
+    for (const auto& item : result) {
+        names_size += item.first.size();
+        if (names_size > static_cast<size_t>(numeric_limits<int32_t>::max())) {
+            throw runtime_error("arrow: names too long for a utf8 column");
+        }
+        offsets.push_back(names_size);
+    }
+
+    // Each column has an empty validity buffer, as there are no nulls.
+    vector<arrow_node> nodes(columns.size() + 1, { n, 0 });
+    vector<arrow_buffer> buffers;
+    int64_t body_size = 0;
+    const auto add = [&](size_t size) {
+        buffers.push_back({ body_size, static_cast<int64_t>(size) });
+        body_size += arrow_padded(size);
+    };
+    add(0);
+    add(offsets.size() * sizeof(int32_t));
+    add(names_size);
+    for (size_t i = 0; i < columns.size(); ++i) {
+        add(0);
+        add(result.size() * sizeof(int64_t));
+    }
+
+    size_t at = 0;
+    const auto put = [&](string_view s) {
+        out.append(s);
+        at += s.size();
+    };
+    const auto put_padded = [&](string_view s) {
+        put(s);
+        put(string_view("\0\0\0\0\0\0\0", arrow_padded(at) - at));
+    };
+    // A message with its metadata, framed as in the stream format.
+    const auto message = [&](const string& metadata) {
+        const uint32_t frame[] = { 0xffffffff, static_cast<uint32_t>(metadata.size()) };
+        put(bytes(frame, 2));
+        put(metadata);
+    };
+
+    if (file) {
+        put_padded("ARROW1");
+    }
+
+    {
+        flatbuffer fb;
+        const auto schema = arrow_schema_table(fb, columns);
+        message(fb.finish(fb.table({ flatbuffer::scalar(0, arrow_v5), flatbuffer::scalar(1, arrow_schema), flatbuffer::child(2, schema) })));
+    }
+
+    arrow_block block { static_cast<int64_t>(at), 0, 0, body_size };
+    {
+        flatbuffer fb;
+        const auto node_list = fb.structs(nodes);
+        const auto buffer_list = fb.structs(buffers);
+        const auto batch = fb.table({ flatbuffer::scalar(0, n), flatbuffer::child(1, node_list), flatbuffer::child(2, buffer_list) });
+        const auto metadata = fb.finish(fb.table({ flatbuffer::scalar(0, arrow_v5), flatbuffer::scalar(1, arrow_record_batch), flatbuffer::child(2, batch), flatbuffer::scalar(3, body_size) }));
+        block.metadata_size = 2 * sizeof(uint32_t) + metadata.size();
+        message(metadata);
+    }
+    put_padded(bytes(offsets.data(), offsets.size()));
+    for (const auto& item : result) {
+        put(item.first);
+    }
+    put_padded({});
+    vector<int64_t> counts;
+    vector<double> values;
+    for (const auto& c : columns) {
+        if (c.what == field::count) {
+            counts.clear();
+            for (const auto& item : result) {
+                counts.push_back(item.second->n);
+            }
+            put_padded(bytes(counts.data(), counts.size()));
+        } else {
+            values.clear();
+            for (const auto& item : result) {
+                values.push_back(value(*item.second, c) / 10.0);
+            }
+            put_padded(bytes(values.data(), values.size()));
+        }
+    }
+    const uint32_t end_of_stream[] = { 0xffffffff, 0 };
+    put(bytes(end_of_stream, 2));
+
+    if (file) {
+        flatbuffer fb;
+        const auto schema = arrow_schema_table(fb, columns);
+        const auto batches = fb.structs(vector<arrow_block> { block });
+        const auto footer = fb.finish(fb.table({ flatbuffer::scalar(0, arrow_v5), flatbuffer::child(1, schema), flatbuffer::child(3, batches) }));
+        put(footer);
+        const auto footer_size = static_cast<int32_t>(footer.size());
+        put(bytes(&footer_size, 1));
+        put("ARROW1");
+    }
+}
+
+//----------------------------------------------------------------------------
+// Early exit. Unmapping a large file and freeing the tables takes a while
+// after the output is complete, which callers waiting for the process to
+// exit can do without.
+
+// With exit_mode::background, the process forks before doing any work. The
+// child does it all, and the parent exits as soon as the child reports
+// that the output is complete, with the status reported. Returns the file
+// descriptor to report on in the child.
+int detach()
+{
+    int fds[2];
+    if (pipe(fds) == -1) {
+        throw runtime_error(strerror(errno));
+    }
+    const pid_t pid = fork();
+    if (pid == -1) {
+        throw runtime_error(strerror(errno));
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        return fds[1];
+    }
+
+    close(fds[1]);
+    unsigned char status;
+    ssize_t n;
+    while ((n = read(fds[0], &status, 1)) == -1 && errno == EINTR) {
+    }
+    if (n == 1) {
+        _exit(status);
+    }
+    // The child failed before the output was complete.
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR) {
+    }
+    _exit(WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus));
+}
+
+// Called once the output is complete, before the teardown.
+void output_done(const options& opts)
+{
+    switch (opts.exit) {
+    case exit_mode::normal:
+        break;
+    case exit_mode::fast:
+        _exit(0);
+    case exit_mode::background: {
+        const unsigned char status = 0;
+        if (write(opts.exit_fd, &status, 1) == -1) {
+            _exit(1);
+        }
+        close(opts.exit_fd);
+        // Readers of the output may wait for it to be closed, too.
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+        break;
+    }
+    }
+}
+
+// Partial results reduced pairwise as the parsers finish. A parser merges
+// its table with the one an earlier parser left, if any, and goes on with
+// the sum until there is none left to merge with. The merges run in
+// parallel, in the order the parsers finish.
+template <typename Stats>
+struct reduction {
+    void add(station_table<Stats> table)
+    {
+        for (;;) {
+            unique_lock lock(mutex_);
+            if (!pending_) {
+                pending_ = move(table);
+                return;
+            }
+            auto other = move(*pending_);
+            pending_.reset();
+            lock.unlock();
+
+            // Fewer entries to go through in the smaller one.
+            if (other.stats.size() > table.stats.size()) {
+                swap(table, other);
+            }
+            table.merge(move(other));
+        }
+    }
+
+    // Once all are added.
+    station_table<Stats> result()
+    {
+        return pending_ ? move(*pending_) : station_table<Stats> {};
+    }
+
+private:
+    mutex mutex_;
+    optional<station_table<Stats>> pending_;
+};
+
+// The first 8 bytes of a name as a big-endian number, padded with zeros,
+// which orders most names in a single integer comparison.
+uint64_t name_prefix(string_view name)
+{
+    uint64_t word = 0;
+    memcpy(&word, name.data(), min<size_t>(name.size(), sizeof(word)));
+    return be64toh(word);
+}
+
+// Names above which the sort is split over threads.
+constexpr size_t parallel_sort_size = 1 << 16;
+
+template <typename Stats>
+ordered_statistics<Stats> ordered(const station_table<Stats>& table, thread_pool& pool)
+{
+    struct entry {
+        uint64_t prefix;
+        string_view name;
+        const Stats* stats;
+    };
+    vector<entry> entries;
+    entries.reserve(table.stats.size());
+    for (const auto& item : table.stats) {
+        entries.push_back({ name_prefix(item.first), item.first, &item.second });
+    }
+    const auto less = [](const entry& a, const entry& b) {
+        return a.prefix != b.prefix ? a.prefix < b.prefix : a.name < b.name;
+    };
+
+    const auto begin = entries.begin();
+    const auto n = pool.size();
+    if (entries.size() <= parallel_sort_size || n < 2) {
+        sort(begin, entries.end(), less);
+    } else {
+        // Sorted in parts, which are then merged pairwise.
+        vector<size_t> bounds;
+        for (unsigned i = 0; i <= n; ++i) {
+            bounds.push_back(entries.size() * i / n);
+        }
+        pool.each([&](unsigned i) { sort(begin + bounds[i], begin + bounds[i + 1], less); });
+        for (unsigned width = 1; width < n; width *= 2) {
+            pool.each([&](unsigned i) {
+                if (i % (2 * width) == 0 && i + width < n) {
+                    inplace_merge(begin + bounds[i], begin + bounds[i + width], begin + bounds[min(i + 2 * width, n)], less);
+                }
+            });
+        }
+    }
+
+    ordered_statistics<Stats> result;
+    result.reserve(entries.size());
+    for (const auto& e : entries) {
+        result.emplace_back(e.name, e.stats);
+    }
+    return result;
+}
+
+// Quoted when it contains a separator, a quote or a line break.
+void append_csv(output_buffer& out, string_view s)
+{
+    if (s.find_first_of(",\"\r\n") == string_view::npos) {
+        out.append(s);
+        return;
+    }
+    out.append('"');
+    for (size_t i; (i = s.find('"')) != string_view::npos; s.remove_prefix(i + 1)) {
+        out.append(s.substr(0, i + 1));
+        out.append('"');
+    }
+    out.append(s);
+    out.append('"');
+}
+
+// A JSON string. Bytes other than quotes, backslashes and control characters
+// are copied as they are, so that UTF-8 names stay UTF-8.
+void append_json(output_buffer& out, string_view s)
+{
+    constexpr char hex[] = "0123456789abcdef";
+    out.append('"');
+    size_t run = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const auto c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(s.substr(run, i - run));
+        run = i + 1;
+        switch (c) {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\b':
+            out.append("\\b");
+            break;
+        case '\f':
+            out.append("\\f");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        default:
+            out.append("\\u00");
+            out.append(hex[c >> 4]);
+            out.append(hex[c & 0xf]);
+        }
+    }
+    out.append(s.substr(run));
+    out.append('"');
+}
+
+template <typename Stats>
+void print(output_buffer& out, const ordered_statistics<Stats>& result, const vector<column>& columns, output_format format)
+{
+    switch (format) {
+    case output_format::tsv:
+        for (const auto& [name, stats] : result) {
+            out.append(name);
+            for (const auto& c : columns) {
+                out.append('\t');
+                print(out, *stats, c);
+            }
+            out.append('\n');
+        }
+        break;
+    case output_format::csv:
+        out.append("station");
+        for (const auto& c : columns) {
+            out.append(',');
+            out.append(column_name(c));
+        }
+        out.append('\n');
+        for (const auto& [name, stats] : result) {
+            append_csv(out, name);
+            for (const auto& c : columns) {
+                out.append(',');
+                print(out, *stats, c);
+            }
+            out.append('\n');
+        }
+        break;
+    case output_format::json: {
+        vector<string> keys;
+        for (const auto& c : columns) {
+            keys.push_back(",\"" + column_name(c) + "\":");
+        }
+        out.append('[');
+        for (const auto& [name, stats] : result) {
+            out.append(&name == &result.front().first ? "\n{\"station\":" : ",\n{\"station\":");
+            append_json(out, name);
+            for (size_t i = 0; i < columns.size(); ++i) {
+                out.append(keys[i]);
+                print(out, *stats, columns[i]);
+            }
+            out.append('}');
+        }
+        out.append("\n]\n");
+        break;
+    }
+    case output_format::canonical:
+        out.append('{');
+        for (const auto& [name, stats] : result) {
+            if (&name != &result.front().first) {
+                out.append(", ");
+            }
+            out.append(name);
+            out.append('=');
+            for (const auto& c : columns) {
+                if (&c != &columns.front()) {
+                    out.append('/');
+                }
+                print(out, *stats, c);
+            }
+        }
+        out.append("}\n");
+        break;
+    case output_format::arrow:
+    case output_format::arrow_stream:
+        print_arrow(out, result, columns, format == output_format::arrow);
+        break;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Partial results, written with --emit-partial and combined with merge.
+// The file holds the exact aggregates, so that merging loses nothing, and
+// is laid out to be used mapped, without parsing:
+//   partial_header
+//   partial_record, a station each, in the order of names
+//   partial_bucket, the non-empty histogram buckets of each station
+//   names, one after the other
+// Numbers are little-endian. A change of layout changes the version.
+
+static_assert(endian::native == endian::little);
+
+constexpr char partial_magic[8] = { '1', 'B', 'R', 'C', 'P', 'A', 'R', 'T' };
+constexpr uint32_t partial_version = 2;
+
+// Aggregators in a file.
+constexpr uint32_t partial_total = 1;
+constexpr uint32_t partial_minimum = 2;
+constexpr uint32_t partial_maximum = 4;
+constexpr uint32_t partial_histogram = 8;
+
+template <typename Stats>
+constexpr uint32_t partial_aggregators = (Stats::template has<total> ? partial_total : 0)
+    | (Stats::template has<minimum> ? partial_minimum : 0)
+    | (Stats::template has<maximum> ? partial_maximum : 0)
+    | (Stats::template has<histogram> ? partial_histogram : 0);
+
+struct partial_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t aggregators;
+    uint64_t stations;
+    uint64_t buckets;
+    uint64_t names_size;
+    uint64_t checksum; // Of the lines of the input, 0 if unknown.
+};
+
+// Fields of aggregators not in the file are zero.
+struct partial_record {
+    uint64_t name_offset;
+    uint64_t name_size;
+    uint64_t buckets_offset;
+    uint64_t buckets_size;
+    uint64_t n;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+};
+
+struct partial_bucket {
+    int64_t value;
+    uint64_t n;
+};
+
+// Written next to path first and renamed over it, so that readers see the
+// whole file or none.
+template <typename Stats>
+void write_partial(const string& path, const ordered_statistics<Stats>& result, uint64_t checksum)
+{
+    partial_header header {};
+    memcpy(header.magic, partial_magic, sizeof(partial_magic));
+    header.version = partial_version;
+    header.aggregators = partial_aggregators<Stats>;
+    header.stations = result.size();
+    header.checksum = checksum;
+    vector<partial_record> records;
+    records.reserve(result.size());
+    vector<partial_bucket> buckets;
+    for (const auto& [name, s] : result) {
+        partial_record r {};
+        r.name_offset = header.names_size;
+        r.name_size = name.size();
+        r.buckets_offset = buckets.size();
+        r.n = s->n;
+        if constexpr (Stats::template has<total>) {
+            r.sum = s->sum;
+        }
+        if constexpr (Stats::template has<minimum>) {
+            r.min = s->min;
+        }
+        if constexpr (Stats::template has<maximum>) {
+            r.max = s->max;
+        }
+        if constexpr (Stats::template has<histogram>) {
+            s->each([&](int64_t x, uint64_t n) { buckets.push_back({ x, n }); });
+        }
+        r.buckets_size = buckets.size() - r.buckets_offset;
+        header.names_size += name.size();
+        records.push_back(r);
+    }
+    header.buckets = buckets.size();
+
+    output_buffer out;
+    out.append(bytes(&header, 1));
+    out.append(bytes(records.data(), records.size()));
+    out.append(bytes(buckets.data(), buckets.size()));
+    for (const auto& item : result) {
+        out.append(item.first);
+    }
+
+    // A temporary file of its own next to the result, so that concurrent
+    // runs writing the same result each rename a complete file into place.
+    string temporary = path + ".XXXXXX";
+    const int fd = mkostemp(temporary.data(), O_CLOEXEC);
+    if (fd == -1) {
+        throw runtime_error(path + ": " + strerror(errno));
+    }
+    try {
+        if (fchmod(fd, 0644) == -1) {
+            throw runtime_error(temporary + ": " + strerror(errno));
+        }
+        out.write_to(fd);
+    } catch (...) {
+        close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+    if (close(fd) == -1 || rename(temporary.c_str(), path.c_str()) == -1) {
+        const auto error = errno;
+        unlink(temporary.c_str());
+        throw runtime_error(path + ": " + strerror(error));
+    }
+}
+
+// A partial result mapped, with its parts checked against the size of the
+// file. Names point into the mapping.
+struct partial_file {
+    partial_file(const string& path)
+        : data_ { file_descr(path) }
+    {
+        const string_view data = data_;
+        const auto invalid = [&](const char* what) {
+            return runtime_error(path + ": " + what);
+        };
+        if (data.size() < sizeof(partial_header) || memcmp(data.data(), partial_magic, sizeof(partial_magic)) != 0) {
+            throw invalid("not a partial result");
+        }
+        header_ = reinterpret_cast<const partial_header*>(data.data());
+        if (header_->version != partial_version) {
+            throw invalid("unsupported partial result version");
+        }
+        const auto records_end = sizeof(partial_header) + header_->stations * sizeof(partial_record);
+        const auto buckets_end = records_end + header_->buckets * sizeof(partial_bucket);
+        if (header_->stations > data.size() || header_->buckets > data.size() || header_->names_size > data.size()
+            || buckets_end + header_->names_size != data.size()) {
+            throw invalid("truncated partial result");
+        }
+        records_ = reinterpret_cast<const partial_record*>(data.data() + sizeof(partial_header));
+        buckets_ = reinterpret_cast<const partial_bucket*>(data.data() + records_end);
+        names_ = data.substr(buckets_end);
+        for (const auto& r : records()) {
+            // Stations are only there for their values, and the mean of
+            // none would divide by zero.
+            if (!r.n || r.name_offset > names_.size() || r.name_size > names_.size() - r.name_offset
+                || r.buckets_offset > header_->buckets || r.buckets_size > header_->buckets - r.buckets_offset) {
+                throw invalid("corrupt partial result");
+            }
+        }
+    }
+
+    uint32_t aggregators() const
+    {
+        return header_->aggregators;
+    }
+
+    uint64_t checksum() const
+    {
+        return header_->checksum;
+    }
+
+    span<const partial_record> records() const
+    {
+        return { records_, header_->stations };
+    }
+
+    string_view name(const partial_record& r) const
+    {
+        return names_.substr(r.name_offset, r.name_size);
+    }
+
+    span<const partial_bucket> buckets(const partial_record& r) const
+    {
+        return { buckets_ + r.buckets_offset, r.buckets_size };
+    }
+
+private:
+    mmap_file data_;
+    const partial_header* header_;
+    const partial_record* records_;
+    const partial_bucket* buckets_;
+    string_view names_;
+};
+
+// The stations of a partial result, keyed by the names in the mapping.
+template <typename Stats>
+station_table<Stats> read_partial(const partial_file& file, const string& path)
+{
+    if (partial_aggregators<Stats> & ~file.aggregators()) {
+        throw runtime_error(path + ": lacks aggregates for the columns");
+    }
+    station_table<Stats> result;
+    result.stats.reserve(file.records().size());
+    result.checksum = file.checksum();
+    for (const auto& r : file.records()) {
+        Stats s;
+        s.n = r.n;
+        if constexpr (Stats::template has<total>) {
+            s.sum = r.sum;
+        }
+        if constexpr (Stats::template has<minimum>) {
+            s.min = r.min;
+        }
+        if constexpr (Stats::template has<maximum>) {
+            s.max = r.max;
+        }
+        if constexpr (Stats::template has<histogram>) {
+            for (const auto& b : file.buckets(r)) {
+                if (b.value < histogram::lowest || b.value > histogram::highest) {
+                    throw runtime_error(path + ": histogram value out of range");
+                }
+                s.histogram::add(b.value, b.n);
+            }
+        }
+        // Names are unique within a file, or merged as in any table.
+        if (const auto [it, inserted] = result.stats.emplace(file.name(r), s); !inserted) {
+            it->second.update(s);
+        }
+    }
+    return result;
+}
+
+//----------------------------------------------------------------------------
+// Result cache. With --cache, the results of each regular file are kept in a
+// directory as partial results, named after the identity of the file: its
+// device, inode, size and modification time. Writing to the file changes its
+// mtime and so the name looked up. The checksum of its lines goes with the
+// results, and --cache-verify checks it against the file, for files changed
+// with their mtime put back.
+
+// Files modified less than this before a run are not cached, as writes within
+// the granularity of the mtime would not change it.
+constexpr auto cache_settle_time = seconds(2);
+
+// Start of the names of the entries of a file, whatever its size and mtime.
+string cache_prefix(const struct stat& st)
+{
+    return to_string(st.st_dev) + "-" + to_string(st.st_ino) + "-";
+}
+
+string cache_entry(const string& dir, const struct stat& st)
+{
+    return dir + "/" + cache_prefix(st) + to_string(st.st_size) + "-" + to_string(st.st_mtim.tv_sec) + "."
+        + to_string(st.st_mtim.tv_nsec) + ".bin";
+}
+
+// Removes the entries of earlier versions of the files of a run, entries[i]
+// of identities[i] unless empty, which would otherwise pile up as the files
+// change. One pass over the directory for all of them.
+void cache_evict(const string& dir, const vector<struct stat>& identities, const vector<string>& entries)
+{
+    unordered_map<string, string_view> current; // Names by prefix.
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].empty()) {
+            current.emplace(cache_prefix(identities[i]), string_view(entries[i]).substr(dir.size() + 1));
+        }
+    }
+    if (current.empty()) {
+        return;
+    }
+    DIR* const d = opendir(dir.c_str());
+    if (!d) {
+        cerr << "cache: " << dir << ": " << strerror(errno) << endl;
+        return;
+    }
+    size_t removed = 0;
+    while (const auto e = readdir(d)) {
+        const string_view name = e->d_name;
+        const auto end = name.find('-', name.find('-') + 1);
+        if (end == string_view::npos || !name.ends_with(".bin")) {
+            continue;
+        }
+        const auto it = current.find(string(name.substr(0, end + 1)));
+        if (it != current.end() && it->second != name && unlinkat(dirfd(d), e->d_name, 0) == 0) {
+            ++removed;
+        }
+    }
+    closedir(d);
+    if (removed) {
+        cerr << "cache: removed " << removed << " stale entries" << endl;
+    }
+}
+
+// Of the lines of a file, mapped and split between the parsers.
+uint64_t file_checksum(const file_descr& fd, thread_pool& pool)
+{
+    if (!fd.size()) {
+        return 0;
+    }
+    const mmap_file file(fd);
+    const string_view data = file;
+    vector<uint64_t> sums(pool.size());
+    pool.each([&](unsigned i) {
+        const auto begin = data.size() * i / pool.size();
+        const auto end = data.size() * (i + 1) / pool.size();
+        if (begin == end) {
+            return;
+        }
+        for (auto lines = lines_in(data, 0, begin, end, data.size(), fd.path()); !lines.empty();) {
+            const auto [line, other_lines] = first_line(lines);
+            sums[i] += line_checksum(line);
+            lines = other_lines;
+        }
+    });
+    uint64_t sum = 0;
+    for (const auto s : sums) {
+        sum += s;
+    }
+    return sum;
+}
+
+// The cached results of a file, unless there are none with the aggregators
+// needed, or they fail verification. Compressed files would have to be
+// decompressed to verify, and are parsed again instead.
+unique_ptr<partial_file> cache_lookup(const string& entry, const file_descr& fd, bool compressed, uint32_t aggregators, bool verify, thread_pool& pool)
+{
+    if (access(entry.c_str(), F_OK) == -1) {
+        return nullptr;
+    }
+    try {
+        auto file = make_unique<partial_file>(entry);
+        if (aggregators & ~file->aggregators()) {
+            return nullptr;
+        }
+        if (verify && (compressed || file->checksum() != file_checksum(fd, pool))) {
+            cerr << "cache: " << entry << " is stale" << endl;
+            return nullptr;
+        }
+        return file;
+    } catch (const runtime_error& e) {
+        cerr << "cache: " << e.what() << endl;
+        return nullptr;
+    }
+}
+
+// Unless the file changed while it was parsed, or so shortly before that the
+// change may not show in its mtime.
+template <typename Stats>
+void cache_store(const string& dir, const struct stat& before, const file_descr& fd, const station_table<Stats>& result, system_clock::time_point start, thread_pool& pool)
+{
+    const auto after = fd.status();
+    const auto mtime = system_clock::time_point(duration_cast<system_clock::duration>(seconds(after.st_mtim.tv_sec) + nanoseconds(after.st_mtim.tv_nsec)));
+    const auto entry = cache_entry(dir, before);
+    if (entry != cache_entry(dir, after) || mtime > start - cache_settle_time) {
+        cerr << "cache: " << entry << " not written, the file changed too recently" << endl;
+        return;
+    }
+    try {
+        write_partial(entry, ordered(result, pool), result.checksum);
+    } catch (const runtime_error& e) {
+        cerr << "cache: " << e.what() << endl;
+    }
+}
+
+//----------------------------------------------------------------------------
+// The pipeline of a run. Each input is a coroutine going through its stages
+// on the pool: open it and start reading, parse and reduce, then finish.
+// A few inputs are open at a time, so that the next one is read or scanned
+// while the one before is parsed, and the results of a file are printed as
+// soon as its inputs are done, while the files after it are parsed.
+
+// Inputs read at a time: the one being parsed and the next.
+constexpr unsigned open_inputs = 2;
+
+// An input, read through a backend opened when its turn comes.
+struct input_job {
+    function<unique_ptr<input_backend>()> open;
+    size_t slot; // For the lines finish() returns.
+    vector<size_t> slots; // Of its files.
+};
+
+template <typename Stats>
+struct pipeline {
+    pipeline(thread_pool& pool, const options& opts, vector<input_job> jobs, size_t n_slots)
+        : pool_ { pool }
+        , opts_ { opts }
+        , jobs_ { move(jobs) }
+        , n_nodes_ { unsigned(max<size_t>(1, opts.node_cpus.size())) }
+        , reduced_(n_slots * n_nodes_)
+        , inputs_ { pool, open_inputs }
+        , pending_(n_slots)
+        , active_ { jobs_.size() }
+    {
+        for (const auto& job : jobs_) {
+            for (const auto slot : job.slots) {
+                ++pending_[slot];
+            }
+        }
+    }
+
+    // Waits for the inputs still going, which refer to the pipeline.
+    ~pipeline()
+    {
+        unique_lock lock(mutex_);
+        changed_.wait(lock, [&] { return !active_; });
+    }
+
+    pipeline(const pipeline&) = delete;
+    pipeline& operator=(const pipeline&) = delete;
+
+    void start()
+    {
+        for (size_t k = 0; k < jobs_.size(); ++k) {
+            parse_input(k);
+        }
+    }
+
+    // Results of a slot once its inputs are done. Throws the first error of
+    // any input.
+    station_table<Stats> result(size_t slot)
+    {
+        unique_lock lock(mutex_);
+        changed_.wait(lock, [&] { return !pending_[slot] || error_; });
+        if (error_) {
+            changed_.wait(lock, [&] { return !active_; });
+            rethrow_exception(error_);
+        }
+        lock.unlock();
+
+        // Tables cross NUMA nodes only once reduced on each.
+        station_table<Stats> table;
+        for (unsigned node = 0; node < n_nodes_; ++node) {
+            table.merge(reduced_[slot * n_nodes_ + node].result());
+        }
+        return table;
+    }
+
+private:
+    detached_task parse_input(size_t k)
+    {
+        co_await inputs_.acquire();
+        try {
+            co_await pool_.schedule();
+            const auto backend = jobs_[k].open();
+
+            vector<parse_cursor> cursors(pool_.size());
+            optional<prefetcher> prefetch;
+            if (opts_.prefetch_threads && backend->prefetchable()) {
+                prefetch.emplace(cursors, opts_.prefetch_threads, opts_.prefetch_distance);
+            }
+
+            co_await fan_out(pool_, pool_.size(), [&](unsigned worker) {
+                const auto node = opts_.places[worker].node;
+                auto tables = aggregate_input<Stats>(*backend, jobs_[k].slots, node, prefetch ? &cursors[worker] : nullptr, !opts_.cache.empty());
+                for (auto& [slot, table] : tables) {
+                    reduced_[slot * n_nodes_ + node].add(move(table));
+                }
+            });
+            prefetch.reset();
+
+            if (const auto leftover = backend->finish(); !leftover.empty()) {
+                station_table<Stats> table;
+                aggregate(leftover, table, !opts_.cache.empty(), [&](const char*) { return backend->where(); });
+                reduced_[jobs_[k].slot * n_nodes_].add(move(table));
+            }
+        } catch (...) {
+            lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = current_exception();
+            }
+        }
+        inputs_.release();
+
+        lock_guard lock(mutex_);
+        for (const auto slot : jobs_[k].slots) {
+            --pending_[slot];
+        }
+        --active_;
+        changed_.notify_all();
+    }
+
+    thread_pool& pool_;
+    const options& opts_;
+    const vector<input_job> jobs_;
+    const unsigned n_nodes_;
+
+    // By slot and by the NUMA node the tables were parsed on.
+    vector<reduction<Stats>> reduced_;
+
+    async_semaphore inputs_;
+    mutex mutex_;
+    condition_variable changed_;
+    vector<size_t> pending_; // Inputs left, by slot.
+    size_t active_; // Inputs not done.
+    exception_ptr error_;
+};
+
+// The end of a run, with everything before in out.
+template <typename Stats>
+void output(output_buffer& out, const station_table<Stats>& total, const options& opts, thread_pool& pool)
+{
+    const auto result = ordered(total, pool);
+    if (!opts.partial.empty()) {
+        write_partial(opts.partial, result, total.checksum);
+    }
+    print(out, result, opts.columns, opts.format);
+    out.write_to(STDOUT_FILENO);
+    output_done(opts);
+}
+
+template <typename Stats>
+void run(const vector<string>& paths, const options& opts, thread_pool& pool)
+{
+    if (opts.merge) {
+        merge_partials<Stats>(paths, opts, pool);
+        return;
+    }
+
+    const auto n_cpus = pool.size();
+    const bool caching = !opts.cache.empty();
+    // Of --max-rss, half is for the input and the rest for the tables and
+    // everything else. Inputs open at the same time share that half.
+    const auto input_budget = opts.max_rss / 2 / open_inputs;
+    const size_t n_slots = opts.per_file || caching ? paths.size() : 1;
+    // Parsers by NUMA node, for shares of the input on the nodes which have
+    // any.
+    vector<unsigned> node_parsers;
+    for (const auto& place : opts.places) {
+        node_parsers.resize(max<size_t>(node_parsers.size(), place.node + 1));
+        ++node_parsers[place.node];
+    }
+
+    // Regular files go through one backend, so that small files are parsed
+    // in parallel with each other. Streams and compressed files get one
+    // each.
+    vector<unique_ptr<file_descr>> files;
+    vector<ranged_file> ranged;
+    vector<input_job> jobs;
+
+    // With caching, the identity of each regular file, where its results are
+    // kept, and the results found there.
+    vector<struct stat> identities(paths.size());
+    vector<string> entries(paths.size());
+    vector<unique_ptr<partial_file>> cached(paths.size());
+    const auto start = system_clock::now();
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        const size_t slot = n_slots > 1 ? i : 0;
+        files.push_back(make_unique<file_descr>(paths[i]));
+        const auto& fd = *files.back();
+        const auto compression = fd.regular() ? detect_codec(fd) : codec::none;
+
+        if (caching && fd.regular()) {
+            identities[i] = fd.status();
+            entries[i] = cache_entry(opts.cache, identities[i]);
+            cached[i] = cache_lookup(entries[i], fd, compression != codec::none, partial_aggregators<Stats>, opts.cache_verify, pool);
+            if (cached[i]) {
+                cerr << "cache: " << paths[i] << " from " << entries[i] << endl;
+                continue;
+            }
+        }
+
+        if (compression != codec::none) {
+            jobs.push_back({ [&fd, compression, slot, n_cpus, input_budget]() -> unique_ptr<input_backend> {
+                // Frame-parallel when there are frames to spread, otherwise
+                // a single decompressor thread. Gzip has no frames to find.
+                if (compression != codec::gzip) {
+                    auto input = make_unique<framed_input>(fd, compression);
+                    if (input->size() > 1) {
+                        return make_unique<framed_backend>(move(input), slot);
+                    }
+                }
+                const auto [size, n] = buffer_plan(stream_buffer_size, n_cpus + 2, input_budget);
+                return make_unique<buffered_backend>(make_unique<decompress_input>(fd, compression, size, n), slot);
+            },
+                slot, { slot } });
+        } else if (!fd.regular() || opts.io == io_mode::stream) {
+            jobs.push_back({ [&fd, slot, n_cpus, input_budget] {
+                const auto [size, n] = buffer_plan(stream_buffer_size, n_cpus + 2, input_budget);
+                return make_unique<buffered_backend>(make_unique<stream_input>(fd, size, n), slot);
+            },
+                slot, { slot } });
+        } else if (opts.io == io_mode::uring) {
+            jobs.push_back({ [&fd, slot, n_cpus, input_budget] {
+                const auto [size, n] = buffer_plan(uring_block_size, uring_depth + n_cpus + 1, input_budget);
+                return make_unique<buffered_backend>(make_unique<uring_input>(fd, size, n), slot);
+            },
+                slot, { slot } });
+        } else {
+            ranged.push_back({ &fd, fd.size(), slot });
+        }
+    }
+
+    // Under a memory limit, an input mapped whole which is larger than it
+    // gets its own pages reclaimed while being parsed. Windows stay within
+    // half of the limit instead.
+    auto max_rss = opts.max_rss;
+    if (!max_rss && opts.memory_limit && (opts.io == io_mode::mmap || opts.io == io_mode::private_mmap)) {
+        size_t total = 0;
+        for (const auto& f : ranged) {
+            total += f.size;
+        }
+        if (total > opts.memory_limit / 2) {
+            max_rss = opts.memory_limit / 2;
+            cerr << "run: " << total << " bytes under a memory limit of " << opts.memory_limit << ", mapping in windows" << endl;
+        }
+    }
+
+    if (!ranged.empty()) {
+        vector<size_t> slots;
+        for (const auto& f : ranged) {
+            if (slots.empty() || slots.back() != f.slot) {
+                slots.push_back(f.slot);
+            }
+        }
+        jobs.insert(jobs.begin(), { [&]() -> unique_ptr<input_backend> {
+            const chunking how { opts.chunk_size, opts.adaptive, node_parsers };
+            // Of the budget, a share for each parser, less what it reads
+            // beyond the end of a range and the alignment of its start.
+            const auto budget = max_rss / 2 / open_inputs;
+            const auto overhead = max_line_size + page_size;
+            const auto share = budget / n_cpus > overhead ? budget / n_cpus - overhead : 0;
+            if (max_rss && opts.io == io_mode::pread) {
+                // A buffer for each parser, ranges sized to fit.
+                const auto range_size = min(opts.chunk_size, max(share, page_size));
+                return make_unique<pread_backend>(ranged, chunking { range_size, opts.adaptive, node_parsers });
+            }
+            if (max_rss) {
+                // A window for each parser, of 1 MiB at least, as fewer
+                // system calls are worth more than parsing on all of them.
+                // As many are mapped at a time as the budget has room for.
+                const auto least = clamp<size_t>(budget, page_size, 1 << 20);
+                const auto window_size = clamp<size_t>(share, least, 64 << 20) & ~(page_size - 1);
+                const auto max_windows = max<size_t>(1, budget / (window_size + overhead));
+                return make_unique<window_backend>(ranged, opts.hints, chunking { window_size, opts.adaptive, node_parsers }, true, max_windows);
+            }
+            if (opts.io == io_mode::private_mmap) {
+                return make_unique<window_backend>(ranged, opts.hints, how, false, 0);
+            }
+            if (opts.io == io_mode::pread) {
+                return make_unique<pread_backend>(ranged, how);
+            }
+            return make_unique<mmap_backend>(ranged, opts.hints, how);
+        },
+            0, move(slots) });
+    }
+
+    pipeline<Stats> inputs(pool, opts, move(jobs), n_slots);
+    inputs.start();
+
+    // The results of a slot: cached, or parsed and then cached.
+    const auto result = [&](size_t i) -> station_table<Stats> {
+        if (cached[i]) {
+            return read_partial<Stats>(*cached[i], entries[i]);
+        }
+        auto table = inputs.result(i);
+        if (!entries[i].empty()) {
+            cache_store(opts.cache, identities[i], *files[i], table, start, pool);
+        }
+        return table;
+    };
+
+    output_buffer out;
+    if (n_slots == 1) {
+        output(out, result(0), opts, pool);
+        return;
+    }
+
+    station_table<Stats> total;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        auto table = result(i);
+        if (opts.per_file) {
+            out.append(i ? "\n==> " : "==> ");
+            out.append(paths[i]);
+            out.append(" <==\n");
+            print(out, ordered(table, pool), opts.columns, opts.format);
+            out.write_to(STDOUT_FILENO);
+        }
+        total.merge(move(table));
+    }
+    if (opts.per_file) {
+        out.append("\n==> total <==\n");
+    }
+    if (caching) {
+        cache_evict(opts.cache, identities, entries);
+    }
+    output(out, total, opts, pool);
+}
+
+// Partial results combined, in parallel: each parser reads its share of the
+// files and adds them to the reduction.
+template <typename Stats>
+void merge_partials(const vector<string>& paths, const options& opts, thread_pool& pool)
+{
+    vector<unique_ptr<partial_file>> files(paths.size());
+    reduction<Stats> sum;
+    pool.each([&](unsigned worker) {
+        for (size_t i = worker; i < paths.size(); i += pool.size()) {
+            files[i] = make_unique<partial_file>(paths[i]);
+            sum.add(read_partial<Stats>(*files[i], paths[i]));
+        }
+    });
+    const auto result = sum.result();
+    output_buffer out;
+    output(out, result, opts, pool);
+}
+
+// Paths matching a glob pattern, or the argument itself if it isn't one.
+vector<string> expand(const char* pattern)
+{
+    if (!strpbrk(pattern, "*?[")) {
+        return { pattern };
+    }
+    glob_t g;
+    const int rc = glob(pattern, 0, nullptr, &g);
+    if (rc == GLOB_NOMATCH) {
+        throw runtime_error(string("no match for ") + pattern);
+    } else if (rc != 0) {
+        throw runtime_error(string("glob failed for ") + pattern);
+    }
+    vector<string> paths(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+    globfree(&g);
+    return paths;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    static const option long_options[] = {
+        { "stats", required_argument, nullptr, 's' },
+        { "format", required_argument, nullptr, 'o' },
+        { "map-hints", required_argument, nullptr, 'm' },
+        { "io", required_argument, nullptr, 'i' },
+        { "per-file", no_argument, nullptr, 'f' },
+        { "emit-partial", required_argument, nullptr, 'e' },
+        { "cache", required_argument, nullptr, 'C' },
+        { "cache-verify", no_argument, nullptr, 'V' },
+        { "exit", required_argument, nullptr, 'x' },
+        { "prefetch", required_argument, nullptr, 'p' },
+        { "prefetch-distance", required_argument, nullptr, 'P' },
+        { "max-rss", required_argument, nullptr, 'r' },
+        { "chunk-size", required_argument, nullptr, 'c' },
+        { "fixed-chunks", no_argument, nullptr, 'F' },
+        { "jobs", required_argument, nullptr, 'j' },
+        { "pin", required_argument, nullptr, 'a' },
+        { "numa", no_argument, nullptr, 'N' },
+        { "spin", required_argument, nullptr, 'w' },
+        {},
+    };
+
+    options opts;
+    opts.columns = parse_columns("min,mean,max");
+
+    // onebrc merge [options] partial... combines partial results.
+    if (argc > 1 && argv[1] == string_view("merge")) {
+        opts.merge = true;
+        argv[1] = argv[0];
+        ++argv;
+        --argc;
+    }
+
+    for (int opt; (opt = getopt_long(argc, argv, "s:o:m:i:fe:C:Vx:p:P:r:c:Fj:a:Nw:", long_options, nullptr)) != -1;) {
+        switch (opt) {
+        case 's':
+            try {
+                opts.columns = parse_columns(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --stats: " << e.what() << endl;
+                return 1;
+            }
+            break;
+        case 'm':
+            try {
+                opts.hints = parse_map_hints(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --map-hints: " << e.what() << endl;
+                return 1;
+            }
+            break;
+        case 'i':
+            if (optarg == string_view("mmap")) {
+                opts.io = io_mode::mmap;
+            } else if (optarg == string_view("private")) {
+                opts.io = io_mode::private_mmap;
+            } else if (optarg == string_view("pread")) {
+                opts.io = io_mode::pread;
+            } else if (optarg == string_view("stream")) {
+                opts.io = io_mode::stream;
+            } else if (optarg == string_view("uring")) {
+                opts.io = io_mode::uring;
+            } else {
+                cerr << argv[0] << ": --io: unknown mode " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'o':
+            if (optarg == string_view("tsv")) {
+                opts.format = output_format::tsv;
+            } else if (optarg == string_view("csv")) {
+                opts.format = output_format::csv;
+            } else if (optarg == string_view("json")) {
+                opts.format = output_format::json;
+            } else if (optarg == string_view("1brc")) {
+                opts.format = output_format::canonical;
+            } else if (optarg == string_view("arrow")) {
+                opts.format = output_format::arrow;
+            } else if (optarg == string_view("arrow-stream")) {
+                opts.format = output_format::arrow_stream;
+            } else {
+                cerr << argv[0] << ": --format: unknown format " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'f':
+            opts.per_file = true;
+            break;
+        case 'e':
+            opts.partial = optarg;
+            break;
+        case 'C':
+            opts.cache = optarg;
+            break;
+        case 'V':
+            opts.cache_verify = true;
+            break;
+        case 'x':
+            if (optarg == string_view("normal")) {
+                opts.exit = exit_mode::normal;
+            } else if (optarg == string_view("fast")) {
+                opts.exit = exit_mode::fast;
+            } else if (optarg == string_view("background")) {
+                opts.exit = exit_mode::background;
+            } else {
+                cerr << argv[0] << ": --exit: unknown mode " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'p':
+            try {
+                opts.prefetch_threads = parse_size(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --prefetch: invalid number " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'P':
+            try {
+                opts.prefetch_distance = parse_size(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --prefetch-distance: invalid size " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'r':
+            try {
+                opts.max_rss = parse_size(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --max-rss: invalid size " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'c':
+            try {
+                opts.chunk_size = parse_size(optarg);
+                if (!opts.chunk_size) {
+                    throw invalid_argument("zero");
+                }
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --chunk-size: invalid size " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'F':
+            opts.adaptive = false;
+            break;
+        case 'j':
+            try {
+                opts.workers = parse_size(optarg);
+                if (!opts.workers) {
+                    throw invalid_argument("zero");
+                }
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --jobs: invalid number " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'N':
+            opts.numa = true;
+            break;
+        case 'w':
+            try {
+                opts.spin = parse_size(optarg);
+            } catch (const invalid_argument& e) {
+                cerr << argv[0] << ": --spin: invalid number " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'a':
+            if (optarg == string_view("none")) {
+                opts.pin = pin_mode::none;
+            } else if (optarg == string_view("compact")) {
+                opts.pin = pin_mode::compact;
+            } else if (optarg == string_view("scatter")) {
+                opts.pin = pin_mode::scatter;
+            } else if (optarg == string_view("cores")) {
+                opts.pin = pin_mode::cores;
+            } else if (optarg == string_view("all")) {
+                opts.pin = pin_mode::all;
             } else {
-                result.insert(item);
+                cerr << argv[0] << ": --pin: unknown policy " << optarg << endl;
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    if (opts.per_file && (opts.format == output_format::arrow || opts.format == output_format::arrow_stream)) {
+        cerr << argv[0] << ": --format: Arrow output has no room for --per-file" << endl;
+        return 1;
+    }
+    if (opts.per_file && (opts.format == output_format::csv || opts.format == output_format::json)) {
+        cerr << argv[0] << ": --format: CSV and JSON output would not parse with --per-file headers" << endl;
+        return 1;
+    }
+
+    if (argc - optind < 1) {
+        cerr << "usage: " << argv[0] << " [-s min,mean,max,count,pNN] [-o tsv|csv|json|1brc|arrow|arrow-stream] [-m populate,sequential,willneed,hugepage,fadvise,readahead|none] [-i mmap|private|pread|stream|uring] [-f] [-e partial] [-C cache-dir] [-V] [-x normal|fast|background] [-p threads] [-P distance] [-r max-rss] [-c chunk-size] [-F] [-j jobs] [-a none|compact|scatter|cores|all] [-N] [-w spin-usec] file|glob..." << endl;
+        cerr << "       " << argv[0] << " merge [options] partial..." << endl;
+        return 1;
+    }
+
+    vector<string> paths;
+    for (int i = optind; i < argc; ++i) {
+        try {
+            for (auto& path : expand(argv[i])) {
+                paths.push_back(move(path));
+            }
+        } catch (const runtime_error& e) {
+            cerr << argv[0] << ": " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    const auto allowed = allowed_cpus();
+    const auto quota = cgroup_cpus();
+    opts.memory_limit = cgroup_memory();
+    const auto cpus = topology(allowed);
+    const auto order = placement(cpus, opts.pin);
+    if (!opts.workers) {
+        opts.workers = opts.pin == pin_mode::cores ? order.size() : allowed.size();
+        if (quota) {
+            opts.workers = min(opts.workers, quota);
+        }
+    }
+    cerr << "workers: " << opts.workers << " (affinity " << allowed.size() << ", cgroup quota " << (quota ? to_string(quota) : "none")
+         << ", memory limit " << (opts.memory_limit ? to_string(opts.memory_limit) : "none") << ")" << endl;
+
+    if (opts.numa) {
+        for (const auto& cpu : cpus) {
+            opts.node_cpus.resize(max<size_t>(opts.node_cpus.size(), cpu.node + 1));
+            opts.node_cpus[cpu.node].push_back(cpu.id);
+        }
+    }
+    // Pinned as placed, or to the CPUs of a node with parsers spread evenly
+    // over the nodes.
+    opts.places.resize(opts.workers);
+    for (unsigned i = 0; i < opts.workers; ++i) {
+        auto& place = opts.places[i];
+        if (!order.empty()) {
+            const auto cpu = order[i % order.size()];
+            place.cpus = { cpu };
+            if (opts.numa) {
+                place.node = find_if(cpus.begin(), cpus.end(), [&](const logical_cpu& c) { return c.id == cpu; })->node;
             }
+        } else if (opts.numa) {
+            place.node = i * opts.node_cpus.size() / opts.workers;
+            place.cpus = opts.node_cpus[place.node];
+        }
+    }
+    if (!order.empty()) {
+        cerr << "pin:";
+        for (const auto& place : opts.places) {
+            cerr << ' ' << place.cpus.front();
+        }
+        cerr << endl;
+    }
+    if (opts.numa) {
+        cerr << "numa: " << opts.node_cpus.size() << " nodes, parsers on";
+        for (const auto& place : opts.places) {
+            cerr << ' ' << place.node;
         }
+        cerr << endl;
+    }
+
+    if (opts.exit == exit_mode::background) {
+        opts.exit_fd = detach();
     }
 
-    cout << fixed << setprecision(1);
-    for (const auto& [name, stats] : result) {
-        cout << name << '\t' << stats << endl;
+    thread_pool pool(opts.places, microseconds(opts.spin));
+
+    // Pick the cheapest instantiation which has everything the columns need.
+    // Partial and cached results have the exact min, max and sum, too.
+    const bool exact = !opts.partial.empty() || !opts.cache.empty();
+    try {
+        if (!exact && provides<count_statistics>(opts.columns)) {
+            run<count_statistics>(paths, opts, pool);
+        } else if (!exact && provides<mean_statistics>(opts.columns)) {
+            run<mean_statistics>(paths, opts, pool);
+        } else if (provides<default_statistics>(opts.columns)) {
+            run<default_statistics>(paths, opts, pool);
+        } else {
+            run<full_statistics>(paths, opts, pool);
+        }
+    } catch (const exception& e) {
+        cerr << argv[0] << ": " << e.what() << endl;
+        return 1;
     }
 
     return 0;